@@ -3,29 +3,222 @@
 */
 #include "avif-handler.h"
 #include <avif/avif.h>
+#include <QThread>
+#include <QStringList>
+#include <QBuffer>
+#include <QFile>
 #include <QDebug>
+#include <vector>
+
+uchar *mapDevice(QIODevice *device, qint64 &size);
+avifIO *createDeviceIO(QIODevice *device);
+
+AvifHandler:: AvifHandler() : decoder(0), decoder_failed(false), next_frame(0),
+                               thread_count(defaultThreadCount()), quality(-1), speed(-1)
+{
+}
+
+AvifHandler:: ~AvifHandler()
+{
+    if (decoder)
+        avifDecoderDestroy(decoder);
+}
 
 bool
 AvifHandler:: canRead() const
 {
+    if (decoder)
+        return next_frame < int(decoder->imageCount);
     return canReadImage(device());
 }
 
 bool
 AvifHandler:: read(QImage *image)
 {
-    QImage decoded = readImage(device());
+    if (!ensureDecoder() or next_frame >= int(decoder->imageCount))
+        return false;
+    // frames are decoded in order, only seek when frames were skipped
+    avifResult result = AVIF_RESULT_OK;
+    if (next_frame == decoder->imageIndex + 1)
+        result = avifDecoderNextImage(decoder);
+    else if (next_frame != decoder->imageIndex)
+        result = avifDecoderNthImage(decoder, next_frame);
+    if (result != AVIF_RESULT_OK) {
+        qDebug() << "Failed to decode frame" << next_frame << ":" << avifResultToString(result);
+        return false;
+    }
+    QImage decoded = imageFromAvif(decoder->image, thread_count, highDepth());
     if (decoded.isNull())
         return false;
     *image = decoded;
+    next_frame++;
+    return true;
+}
+
+bool
+AvifHandler:: supportsOption(ImageOption option) const
+{
+    return option == Size or option == ImageFormat or
+           option == Quality or option == Description;
+}
+
+QVariant
+AvifHandler:: option(ImageOption option) const
+{
+    switch (option) {
+    case Quality:
+        return quality;
+    case Size:
+    case ImageFormat:
+        break;
+    default:
+        return QVariant();
+    }
+    // answered after parsing the container, without decoding any frame
+    if (!ensureDecoder())
+        return QVariant();
+    if (option == Size)
+        return QSize(decoder->image->width, decoder->image->height);
+    return imageFormat(decoder->image, decoder->alphaPresent, highDepth());
+}
+
+void
+AvifHandler:: setOption(ImageOption option, const QVariant &value)
+{
+    switch (option) {
+    case Quality:
+        quality = value.toInt();
+        break;
+    case Description:
+        // QImageWriter::setText("speed", "8") gives "speed: 8"
+        foreach (QString pair, value.toString().split("\n\n")) {
+            QString key = pair.section(':', 0, 0).trimmed().toLower();
+            bool ok;
+            int val = pair.section(':', 1).trimmed().toInt(&ok);
+            if (key == "speed" and ok)
+                speed = qBound(-1, val, 10);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+int
+AvifHandler:: imageCount() const
+{
+    if (!ensureDecoder())
+        return 0;
+    return decoder->imageCount;
+}
+
+int
+AvifHandler:: currentImageNumber() const
+{
+    return next_frame - 1;
+}
+
+int
+AvifHandler:: nextImageDelay() const
+{
+    avifImageTiming timing;
+    if (!decoder or next_frame < 1 or
+        avifDecoderNthImageTiming(decoder, next_frame - 1, &timing) != AVIF_RESULT_OK)
+        return 0;
+    return qRound(timing.duration * 1000);
+}
+
+int
+AvifHandler:: loopCount() const
+{
+    if (!ensureDecoder() or decoder->imageCount < 2)
+        return 0;
+#if AVIF_VERSION >= 1000000
+    if (decoder->repetitionCount >= 0)
+        return decoder->repetitionCount;
+#endif
+    return -1;
+}
+
+bool
+AvifHandler:: jumpToNextImage()
+{
+    if (!ensureDecoder() or next_frame >= int(decoder->imageCount))
+        return false;
+    next_frame++;
+    return true;
+}
+
+bool
+AvifHandler:: jumpToImage(int image_number)
+{
+    if (!ensureDecoder() or image_number < 0 or image_number >= int(decoder->imageCount))
+        return false;
+    next_frame = image_number;
+    return true;
+}
+
+// while reading, a Quality below 50 asks for 8 bit output of 10 and 12 bit
+// images, to use half the memory
+bool
+AvifHandler:: highDepth() const
+{
+    return quality < 0 or quality >= 50;
+}
+
+bool
+AvifHandler:: ensureDecoder() const
+{
+    if (decoder)
+        return true;
+    if (decoder_failed or !device())
+        return false;
+    avifResult result;
+    qint64 size;
+    uchar *mapped;
+    decoder = avifDecoderCreate();
+    // used by AV1 codec for tile and frame threading
+    decoder->maxThreads = thread_count;
+
+    // QBuffer and QFile data is used in place without copying, and file
+    // mapping lives until the file is closed. other seekable devices are
+    // read on demand, only the ranges which libavif asks for
+    mapped = mapDevice(device(), size);
+    if (!mapped and !device()->isSequential())
+        avifDecoderSetIO(decoder, createDeviceIO(device()));
+    else {
+        // libavif reads from data for all frames, so it is kept with decoder
+        if (mapped) {
+            data = QByteArray::fromRawData((const char*) mapped, size);
+            device()->seek(device()->pos() + size);
+        }
+        else
+            data = device()->readAll();
+        result = avifDecoderSetIOMemory(decoder, (const uint8_t*) data.constData(), data.size());
+        if (result != AVIF_RESULT_OK) {
+            qDebug() << "Cannot set IO on avifDecoder";
+            goto fail;
+        }
+    }
+    result = avifDecoderParse(decoder);
+    if (result != AVIF_RESULT_OK) {
+        qDebug() << "Failed to decode image :" << avifResultToString(result);
+        goto fail;
+    }
     return true;
+fail:
+    avifDecoderDestroy(decoder);
+    decoder = 0;
+    data.clear();
+    decoder_failed = true;
+    return false;
 }
 
-/*bool
+bool
 AvifHandler:: write(const QImage &image)
 {
-    return writeImage(image, device());
-}*/
+    return writeImage(image, device(), quality, speed, thread_count);
+}
 
 
 
@@ -33,9 +226,9 @@ bool isAvif(QIODevice *device)
 {
     if (device->size() < 20)
         return false;
-    device->seek(8);
     QByteArray bytes = device->peek(12);
-    if (bytes.startsWith("avif") and bytes.endsWith("avif"))
+    // ftyp box with major brand avif, or avis for image sequences
+    if (bytes.mid(4, 4) == "ftyp" and (bytes.mid(8, 4) == "avif" or bytes.mid(8, 4) == "avis"))
         return true;
     return false;
 }
@@ -45,63 +238,324 @@ bool canReadImage(QIODevice *device)
     return (device && isAvif(device));
 }
 
+/* memory of the data left in a QBuffer, or a QFile which is mapped, so that
+   it can be decoded without copying. returns NULL for other devices.
+*/
+uchar *mapDevice(QIODevice *device, qint64 &size)
+{
+    qint64 pos = device->pos();
+    size = device->size() - pos;
+    if (size <= 0)
+        return NULL;
+    QBuffer *buffer = qobject_cast<QBuffer*>(device);
+    if (buffer)
+        return (uchar*) buffer->buffer().constData() + pos;
+    QFile *file = qobject_cast<QFile*>(device);
+    if (file)
+        return file->map(pos, size);
+    return NULL;
+}
+
+// avifIO which reads the requested ranges from a seekable device
+struct DeviceIO
+{
+    avifIO io;// must be first, as libavif gives back pointer to it
+    QIODevice *device;
+    qint64 start;// device position where the AVIF data begins
+    QByteArray buffer;// holds data of last read, until next read
+};
+
+static void deviceIODestroy(avifIO *io)
+{
+    delete (DeviceIO*) io;
+}
+
+static avifResult deviceIORead(avifIO *io, uint32_t read_flags, uint64_t offset, size_t size,
+                               avifROData *out)
+{
+    DeviceIO *device_io = (DeviceIO*) io;
+    if (read_flags != 0 or offset > io->sizeHint)
+        return AVIF_RESULT_IO_ERROR;
+    size = qMin<uint64_t>(size, io->sizeHint - offset);
+    if (!device_io->device->seek(device_io->start + offset))
+        return AVIF_RESULT_IO_ERROR;
+    device_io->buffer.resize(size);
+    if (device_io->device->read(device_io->buffer.data(), size) != qint64(size))
+        return AVIF_RESULT_IO_ERROR;
+    out->data = (const uint8_t*) device_io->buffer.constData();
+    out->size = size;
+    return AVIF_RESULT_OK;
+}
+
+// the device must be seekable, and outlive the decoder which owns the avifIO
+avifIO *createDeviceIO(QIODevice *device)
+{
+    DeviceIO *device_io = new DeviceIO();
+    device_io->device = device;
+    device_io->start = device->pos();
+    device_io->io.destroy = deviceIODestroy;
+    device_io->io.read = deviceIORead;
+    device_io->io.write = NULL;
+    device_io->io.sizeHint = qMax(device->size() - device_io->start, qint64(0));
+    device_io->io.persistent = AVIF_FALSE;
+    device_io->io.data = NULL;
+    return (avifIO*) device_io;
+}
+
 bool isBigEndian()
 {
     int i=1; return ! *((char *)&i);
 }
 
-QImage readImage(QIODevice *device)
+// QAVIF_NUM_THREADS environment variable overrides the ideal thread count
+int defaultThreadCount()
+{
+    bool ok;
+    int count = qgetenv("QAVIF_NUM_THREADS").toInt(&ok);
+    if (ok and count > 0)
+        return count;
+    return qMax(QThread::idealThreadCount(), 1);
+}
+
+// format of the QImage to which avif_image is decoded. images of more than
+// 8 bit depth are decoded to RGBA64 when high_depth is true (needs Qt 5.12),
+// and monochrome images without alpha to Grayscale8 (Qt 5.5) or Grayscale16
+// (Qt 5.13)
+QImage::Format imageFormat(const avifImage *avif_image, bool has_alpha, bool high_depth)
+{
+    high_depth = high_depth and avif_image->depth > 8;
+#if QT_VERSION >= QT_VERSION_CHECK(5,5,0)
+    if (avif_image->yuvFormat == AVIF_PIXEL_FORMAT_YUV400 and not has_alpha) {
+#if QT_VERSION >= QT_VERSION_CHECK(5,13,0)
+        if (high_depth)
+            return QImage::Format_Grayscale16;
+#endif
+        return QImage::Format_Grayscale8;
+    }
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+    if (high_depth)
+        return has_alpha ? QImage::Format_RGBA64 : QImage::Format_RGBX64;
+#endif
+    return has_alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32;
+}
+
+// copies Y plane of a monochrome image to a Grayscale8 or Grayscale16
+// QImage, as there is no need of color conversion. limited range samples
+// are expanded to full range.
+void grayFromAvif(const avifImage *avif_image, QImage &image)
 {
-    QByteArray bArr = device->readAll();
-    const uchar *data = (uchar*) bArr.constData();
-    size_t size = bArr.size();
+    int depth = avif_image->depth;
+    int max_in = (1 << depth) - 1;
+    int max_out = image.depth() == 16 ? 65535 : 255;
+    const uint8_t *plane = avif_image->yuvPlanes[AVIF_CHAN_Y];
+    size_t row_bytes = avif_image->yuvRowBytes[AVIF_CHAN_Y];
+    bool limited = avif_image->yuvRange == AVIF_RANGE_LIMITED;
 
-    QImage image;
-    QImage::Format format = QImage::Format_RGB32;
+    if (depth == 8 and max_out == 255 and not limited) {
+        for (int y=0; y<image.height(); y++)
+            memcpy(image.scanLine(y), plane + y * row_bytes, image.width());
+        return;
+    }
+    // lookup table from Y sample to gray value
+    std::vector<quint16> table(max_in + 1);
+    for (int v=0; v<=max_in; v++) {
+        double val = v / double(max_in);
+        if (limited)
+            val = (v - (16 << (depth - 8))) / double(219 << (depth - 8));
+        table[v] = qBound(0, qRound(val * max_out), max_out);
+    }
+    for (int y=0; y<image.height(); y++) {
+        const uint8_t *src = plane + y * row_bytes;
+        uchar *dst = image.scanLine(y);
+        for (int x=0; x<image.width(); x++) {
+            int v = depth > 8 ? ((const uint16_t*)src)[x] : src[x];
+            quint16 gray = table[qMin(v, max_in)];
+            if (max_out == 65535)
+                ((quint16*)dst)[x] = gray;
+            else
+                dst[x] = gray;
+        }
+    }
+}
+
+QImage imageFromAvif(const avifImage *avif_image, int threads, bool high_depth)
+{
+    QImage::Format format = imageFormat(avif_image, avif_image->alphaPlane != NULL, high_depth);
+    QImage image(avif_image->width, avif_image->height, format);
+    if (image.isNull())
+        return image;
+    // only grayscale formats have less than 32 bit depth here
+    if (image.depth() <= 16) {
+        grayFromAvif(avif_image, image);
+        return image;
+    }
 
     avifRGBImage rgb;
     memset(&rgb, 0, sizeof(rgb));
+    avifRGBImageSetDefaults(&rgb, avif_image);
+    if (image.depth() == 64) {
+        // RGBA64 is 16 bit R,G,B,A in native byte order, libavif scales
+        // samples up to 16 bit, and fills alpha with opaque when absent
+        rgb.depth = 16;
+        rgb.format = AVIF_RGB_FORMAT_RGBA;
+    }
+    else {
+        rgb.depth = 8;
+        if (isBigEndian())
+            rgb.format = AVIF_RGB_FORMAT_ARGB;
+        else
+            rgb.format = AVIF_RGB_FORMAT_BGRA;
+    }
+    rgb.pixels = image.bits();
+    rgb.rowBytes = image.bytesPerLine();
+    // keep the default libyuv accelerated conversion, and since libavif 1.0
+    // split the rows among threads where libyuv can not be used
+#if AVIF_VERSION >= 1000000
+    rgb.maxThreads = threads;
+#else
+    Q_UNUSED(threads);
+#endif
 
-    avifDecoder *decoder = avifDecoderCreate();
-
-    avifResult result = avifDecoderSetIOMemory(decoder, data, size);
+    avifResult result = avifImageYUVToRGB(avif_image, &rgb);
     if (result != AVIF_RESULT_OK) {
-        qDebug() << "Cannot set IO on avifDecoder";
-        goto cleanup;
+        qDebug() << "Conversion from YUV failed: " << avifResultToString(result);
+        return QImage();
     }
+    return image;
+}
 
-    if (avifDecoderParse(decoder) != AVIF_RESULT_OK) {
-        qDebug() << "Failed to decode image";
-        goto cleanup;
-    }
 
-    if (avifDecoderNextImage(decoder) != AVIF_RESULT_OK){
-        goto cleanup;
+// ************** Write Image *******************
+
+// formats with more than 8 bits per color channel
+bool isHighDepth(QImage::Format format)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+    switch (format) {
+    case QImage::Format_BGR30:
+    case QImage::Format_A2BGR30_Premultiplied:
+    case QImage::Format_RGB30:
+    case QImage::Format_A2RGB30_Premultiplied:
+    case QImage::Format_RGBX64:
+    case QImage::Format_RGBA64:
+    case QImage::Format_RGBA64_Premultiplied:
+#if QT_VERSION >= QT_VERSION_CHECK(5,13,0)
+    case QImage::Format_Grayscale16:
+#endif
+        return true;
+    default:
+        break;
     }
+#else
+    Q_UNUSED(format);
+#endif
+    return false;
+}
 
-    avifRGBImageSetDefaults(&rgb, decoder->image);
-    rgb.depth = 8;
-    if (isBigEndian())
-        rgb.format = AVIF_RGB_FORMAT_ARGB;
-    else
-        rgb.format = AVIF_RGB_FORMAT_BGRA;
+/* quality : 0 to 100, where 100 is lossless, default (-1) is 75
+   speed : avifEncoder speed from 0 (slowest and smallest) to 10 (fastest),
+        default (-1) is libavif default
+   Images with more than 8 bits per channel are encoded with 10 bit depth
+   (since Qt 5.12).
+*/
+bool writeImage(QImage image, QIODevice *device, int quality, int speed, int threads)
+{
+    if (image.isNull())
+        return false;
+    bool success = false;
+    if (quality < 0 or quality > 100)
+        quality = 75;
+    bool lossless = quality == 100;
+    bool high_depth = isHighDepth(image.format());
 
-    if (decoder->image->alphaPlane) {
-        format = QImage::Format_ARGB32;
+    avifRWData output = AVIF_DATA_EMPTY;
+    avifEncoder *encoder = NULL;
+    avifResult result;
+    avifRGBImage rgb;
+    memset(&rgb, 0, sizeof(rgb));
+
+    // 32 and 64 bit formats are read straight from the QImage scanlines
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+    if (high_depth) {
+        if (image.format() != QImage::Format_RGBX64 and image.format() != QImage::Format_RGBA64
+                and image.format() != QImage::Format_RGBA64_Premultiplied) {
+            if (image.hasAlphaChannel())
+                image = image.convertToFormat(QImage::Format_RGBA64);
+            else
+                image = image.convertToFormat(QImage::Format_RGBX64);
+        }
+    }
+    else
+#endif
+    if (image.format() != QImage::Format_RGB32 and image.format() != QImage::Format_ARGB32
+            and image.format() != QImage::Format_ARGB32_Premultiplied) {
+        if (image.hasAlphaChannel())
+            image = image.convertToFormat(QImage::Format_ARGB32);
+        else
+            image = image.convertToFormat(QImage::Format_RGB32);
     }
 
-    image = QImage(decoder->image->width, decoder->image->height, format);
-    rgb.pixels = image.bits();
-    rgb.rowBytes = 4*decoder->image->width;
+    // lossless encoding needs YUV444 with identity matrix, i.e GBR planes
+    avifImage *avif_image = avifImageCreate(image.width(), image.height(), high_depth ? 10 : 8,
+                        lossless ? AVIF_PIXEL_FORMAT_YUV444 : AVIF_PIXEL_FORMAT_YUV420);
+    if (lossless)
+        avif_image->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_IDENTITY;
+
+    avifRGBImageSetDefaults(&rgb, avif_image);
+    if (image.depth() == 64) {
+        rgb.depth = 16;
+        rgb.format = AVIF_RGB_FORMAT_RGBA;
+    }
+    else {
+        rgb.depth = 8;
+        if (isBigEndian())
+            rgb.format = AVIF_RGB_FORMAT_ARGB;
+        else
+            rgb.format = AVIF_RGB_FORMAT_BGRA;
+    }
+    rgb.ignoreAlpha = not image.hasAlphaChannel();
+    rgb.alphaPremultiplied = image.format() == QImage::Format_ARGB32_Premultiplied;
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+    rgb.alphaPremultiplied = rgb.alphaPremultiplied or
+                             image.format() == QImage::Format_RGBA64_Premultiplied;
+#endif
+    // libavif only reads from it
+    rgb.pixels = const_cast<uint8_t*>(image.constBits());
+    rgb.rowBytes = image.bytesPerLine();
+#if AVIF_VERSION >= 1000000
+    rgb.maxThreads = threads;
+#endif
 
-    result = avifImageYUVToRGB(decoder->image, &rgb);
+    result = avifImageRGBToYUV(avif_image, &rgb);
     if (result != AVIF_RESULT_OK) {
-        qDebug() << "Conversion from YUV failed: " << avifResultToString(result);
-        goto cleanup;
+        qDebug() << "Conversion to YUV failed: " << avifResultToString(result);
+        goto end;
     }
 
-cleanup:
-    avifDecoderDestroy(decoder);
-    return image;
-}
+    encoder = avifEncoderCreate();
+    encoder->maxThreads = threads;
+    if (speed >= 0)
+        encoder->speed = speed;
+#if AVIF_VERSION >= 1000000
+    encoder->quality = quality;
+    encoder->qualityAlpha = quality;
+#else
+    // quantizer ranges from 0 (lossless) to 63 (worst quality)
+    encoder->minQuantizer = encoder->maxQuantizer = (100 - quality) * 63 / 100;
+    encoder->minQuantizerAlpha = encoder->maxQuantizerAlpha = (100 - quality) * 63 / 100;
+#endif
 
+    result = avifEncoderWrite(encoder, avif_image, &output);
+    if (result != AVIF_RESULT_OK) {
+        qDebug() << "Failed to encode image: " << avifResultToString(result);
+        goto end;
+    }
+    success = device->write((const char*)output.data, output.size) == qint64(output.size);
+end:
+    avifRWDataFree(&output);
+    if (encoder)
+        avifEncoderDestroy(encoder);
+    avifImageDestroy(avif_image);
+    return success;
+}
@@ -1,16 +1,45 @@
 #pragma once
 #include <QImageIOHandler>
 #include <QImage>
+#include <QVariant>
+#include <avif/avif.h>
 
 class AvifHandler : public QImageIOHandler
 {
 public:
+    AvifHandler();
+    ~AvifHandler();
     bool canRead() const;
     bool read(QImage *image);
-    //bool write(const QImage &image);
+    bool write(const QImage &image);
+    bool supportsOption(ImageOption option) const;
+    QVariant option(ImageOption option) const;
+    void setOption(ImageOption option, const QVariant &value);
+    int imageCount() const;
+    int currentImageNumber() const;
+    int nextImageDelay() const;
+    int loopCount() const;
+    bool jumpToNextImage();
+    bool jumpToImage(int image_number);
+private:
+    bool ensureDecoder() const;
+    bool highDepth() const;
+    // the decoder is kept alive across frames, and is created lazily by
+    // const functions like imageCount()
+    mutable avifDecoder *decoder;
+    // compressed data, unused when the device is read on demand through avifIO
+    mutable QByteArray data;
+    mutable bool decoder_failed;
+    int next_frame;
+    int thread_count;
+    int quality;
+    int speed;
 };
 
 bool canReadImage(QIODevice *device);
-QImage readImage(QIODevice *device);
-//bool writeImage(QImage image, QIODevice *device);
+QImage imageFromAvif(const avifImage *avif_image, int threads=1, bool high_depth=true);
+QImage::Format imageFormat(const avifImage *avif_image, bool has_alpha, bool high_depth=true);
+bool writeImage(QImage image, QIODevice *device, int quality=-1, int speed=-1,
+                int threads=1);
 
+int defaultThreadCount();
@@ -15,7 +15,7 @@ QImageIOPlugin::Capabilities
 AvifPlugin:: capabilities(QIODevice *device, const QByteArray &format) const
 {
     if (format == "avif") {
-        return Capabilities(CanRead/* | CanWrite*/);
+        return Capabilities(CanRead | CanWrite);
     }
     Capabilities cap;
     if (!format.isEmpty() or !device->isOpen())
@@ -23,8 +23,8 @@ AvifPlugin:: capabilities(QIODevice *device, const QByteArray &format) const
 
     if (device->isReadable() && canReadImage(device))
         cap |= CanRead;
-    /*if (device->isWritable())
-        cap |= CanWrite;*/
+    if (device->isWritable())
+        cap |= CanWrite;
     return cap;
 }
 
@@ -0,0 +1,306 @@
+/*  This file is a part of qt-imageformat-plugins project, and is GNU LGPLv2.1 licensed
+*/
+#include "bench.h"
+#include <QImageReader>
+#include <QImageWriter>
+#include <QImageIOPlugin>
+#include <QPluginLoader>
+#include <QLibrary>
+#include <QBuffer>
+#include <QDir>
+#include <QFile>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QtMath>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+#if defined(Q_OS_UNIX)
+#include <sys/resource.h>
+#endif
+
+// format:mode:api:WxH:depth:repeat, used to pass a case to child process
+QString caseToString(const BenchCase &bench_case)
+{
+    return QString("%1:%2:%3:%4x%5:%6:%7").arg(bench_case.format, bench_case.mode, bench_case.api)
+            .arg(bench_case.size.width()).arg(bench_case.size.height())
+            .arg(bench_case.depth).arg(bench_case.repeat);
+}
+
+bool caseFromString(QString str, BenchCase &bench_case)
+{
+    QStringList list = str.split(':');
+    if (list.size() != 6)
+        return false;
+    QStringList size = list[3].split('x');
+    if (size.size() != 2)
+        return false;
+    bench_case.format = list[0];
+    bench_case.mode = list[1];
+    bench_case.api = list[2];
+    bench_case.size = QSize(size[0].toInt(), size[1].toInt());
+    bench_case.depth = list[4];
+    bench_case.repeat = list[5].toInt();
+    return not bench_case.size.isEmpty() and bench_case.repeat > 0;
+}
+
+/* generates the same image for same size and depth every time. smooth
+   gradients, a ring pattern, flat blocks and some noise, so that neither
+   the lossless nor the lossy coders get an unrealistically easy input.
+   returns null image if depth is not supported by this Qt version.
+*/
+QImage syntheticImage(QSize size, QString depth)
+{
+    QImage::Format format = QImage::Format_Invalid;
+    if (depth == "rgb8")
+        format = QImage::Format_RGB32;
+    else if (depth == "rgba8")
+        format = QImage::Format_ARGB32;
+#if QT_VERSION >= QT_VERSION_CHECK(5,5,0)
+    else if (depth == "gray8")
+        format = QImage::Format_Grayscale8;
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+    else if (depth == "rgb16")
+        format = QImage::Format_RGBX64;
+#endif
+    if (format == QImage::Format_Invalid)
+        return QImage();
+    QImage image(size, format);
+    if (image.isNull())
+        return image;
+
+    int w = size.width();
+    int h = size.height();
+    quint32 seed = 12345;
+    for (int y=0; y<h; y++) {
+        uchar *line = image.scanLine(y);
+        for (int x=0; x<w; x++) {
+            seed = seed * 1664525 + 1013904223;// LCG
+            int noise = int(seed >> 24) - 128;
+            // 16 bit samples
+            int r = 65535LL * x / w;
+            int g = 65535LL * y / h;
+            int b = 32768 + 32767 * sin((double(x) * x + double(y) * y) / (w * 8.0));
+            if ((x / 64 + y / 64) % 5 == 0)
+                r = g = b = 0x6000 + ((x / 64) % 4) * 0x2000;
+            r = qBound(0, r + noise * 64, 65535);
+            g = qBound(0, g + noise * 64, 65535);
+            b = qBound(0, b + noise * 64, 65535);
+            int a = qBound(0, 65535 - 65535 * (x + y) / (w + h) + 0x2000, 65535);
+            switch (format) {
+#if QT_VERSION >= QT_VERSION_CHECK(5,5,0)
+            case QImage::Format_Grayscale8:
+                line[x] = (r * 11 + g * 16 + b * 5) >> 13;
+                break;
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+            case QImage::Format_RGBX64:
+                ((QRgba64*) line)[x] = QRgba64::fromRgba64(r, g, b, 65535);
+                break;
+#endif
+            default:
+                ((QRgb*) line)[x] = qRgba(r >> 8, g >> 8, b >> 8,
+                                          format == QImage::Format_ARGB32 ? a >> 8 : 255);
+                break;
+            }
+        }
+    }
+    return image;
+}
+
+// plugin library of given format in dir, e.g libqjp2.so or qjp2.dll
+QString findPlugin(QString dir, QString format)
+{
+    QDir plugin_dir(dir);
+    QStringList filters;
+    filters << "libq" + format + ".*" << "q" + format + ".*";
+    foreach (QString name, plugin_dir.entryList(filters, QDir::Files)) {
+        if (QLibrary::isLibrary(name))
+            return plugin_dir.absoluteFilePath(name);
+    }
+    return QString();
+}
+
+qint64 peakRssKb()
+{
+#if defined(Q_OS_UNIX)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#if defined(Q_OS_MAC)
+    return usage.ru_maxrss / 1024;// bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return -1;
+#endif
+}
+
+// nearest rank percentile of sorted values
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    int rank = qCeil(p / 100 * sorted.size());
+    return sorted[qBound(1, rank, int(sorted.size())) - 1];
+}
+
+static double round3(double val)
+{
+    return qRound64(val * 1000) / 1000.0;
+}
+
+// runs the operation of bench_case once. encoded data is input of decoding
+// modes, and output of encode mode, where image is the input
+static bool runOnce(const BenchCase &bench_case, QImageIOPlugin *plugin, const QImage &image,
+                    QByteArray &data)
+{
+    QByteArray format = bench_case.format.toLatin1();
+    QSize size = bench_case.size;
+    QSize scaled_size = (size / 4).expandedTo(QSize(1, 1));
+    QRect clip_rect(size.width() / 4, size.height() / 4,
+                    qMax(size.width() / 2, 1), qMax(size.height() / 2, 1));
+    QBuffer buffer(&data);
+
+    if (bench_case.mode == "encode") {
+        data.clear();
+        buffer.open(QIODevice::WriteOnly);
+        if (!plugin) {
+            QImageWriter writer(&buffer, format);
+            return writer.write(image);
+        }
+        QImageIOHandler *handler = plugin->create(&buffer, format);
+        if (!handler)
+            return false;
+        bool ok = handler->write(image);
+        delete handler;
+        return ok;
+    }
+
+    buffer.open(QIODevice::ReadOnly);
+    if (!plugin) {
+        QImageReader reader(&buffer, format);
+        if (bench_case.mode == "probe")
+            return reader.size().isValid() and reader.imageFormat() != QImage::Format_Invalid;
+        if (bench_case.mode == "scaled")
+            reader.setScaledSize(scaled_size);
+        else if (bench_case.mode == "clipped")
+            reader.setClipRect(clip_rect);
+        return not reader.read().isNull();
+    }
+
+    QImageIOHandler *handler = plugin->create(&buffer, format);
+    if (!handler)
+        return false;
+    QImage out;
+    bool ok;
+    if (bench_case.mode == "probe") {
+        ok = handler->option(QImageIOHandler::Size).toSize().isValid() and
+             handler->option(QImageIOHandler::ImageFormat).toInt() != QImage::Format_Invalid;
+        delete handler;
+        return ok;
+    }
+    // same as QImageReader, when the handler can not do it while decoding
+    bool scale = bench_case.mode == "scaled";
+    bool clip = bench_case.mode == "clipped";
+    if (scale and handler->supportsOption(QImageIOHandler::ScaledSize)) {
+        handler->setOption(QImageIOHandler::ScaledSize, scaled_size);
+        scale = false;
+    }
+    if (clip and handler->supportsOption(QImageIOHandler::ClipRect)) {
+        handler->setOption(QImageIOHandler::ClipRect, clip_rect);
+        clip = false;
+    }
+    ok = handler->read(&out);
+    delete handler;
+    if (ok and clip)
+        out = out.copy(clip_rect);
+    if (ok and scale)
+        out = out.scaled(scaled_size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    return ok and not out.isNull();
+}
+
+/* runs bench_case once for warm up and then repeat times, and returns the
+   result with latency percentiles in ms, and megapixels per second, where
+   megapixels are of the source image in every mode.
+   plugin_dir is used for the handler api, the reader api uses the plugins
+   found by Qt in library paths.
+   encode mode generates the image, and saves the encoded data to corpus_file
+   if it is given. other modes only load the encoded data from corpus_file, so
+   that the encoder's memory is not counted in their peak RSS.
+*/
+QJsonObject runCase(const BenchCase &bench_case, QString plugin_dir, QString corpus_file)
+{
+    QJsonObject result;
+    result["format"] = bench_case.format;
+    result["mode"] = bench_case.mode;
+    result["api"] = bench_case.api;
+    result["width"] = bench_case.size.width();
+    result["height"] = bench_case.size.height();
+    result["depth"] = bench_case.depth;
+    result["repeat"] = bench_case.repeat;
+    result["qt"] = QString(qVersion());
+
+    bool encode = bench_case.mode == "encode";
+    QImage image;
+    QByteArray data;
+    if (encode) {
+        image = syntheticImage(bench_case.size, bench_case.depth);
+        if (image.isNull()) {
+            result["error"] = QString("depth not supported");
+            return result;
+        }
+    }
+    else {
+        QFile file(corpus_file);
+        if (file.open(QIODevice::ReadOnly))
+            data = file.readAll();
+        if (data.isEmpty()) {
+            result["error"] = QString("encoded input not found");
+            return result;
+        }
+    }
+    QPluginLoader loader;
+    QImageIOPlugin *plugin = NULL;
+    if (bench_case.api == "handler") {
+        loader.setFileName(findPlugin(plugin_dir, bench_case.format));
+        plugin = qobject_cast<QImageIOPlugin*>(loader.instance());
+        if (!plugin) {
+            result["error"] = "plugin not loaded : " + loader.errorString();
+            return result;
+        }
+    }
+
+    std::vector<double> latency;
+    double total = 0;
+    for (int i=0; i<=bench_case.repeat; i++) {
+        QElapsedTimer timer;
+        timer.start();
+        bool ok = runOnce(bench_case, plugin, image, data);
+        double ms = timer.nsecsElapsed() / 1e6;
+        if (!ok) {
+            result["error"] = bench_case.mode + " failed";
+            return result;
+        }
+        if (i == 0)// warm up
+            continue;
+        latency.push_back(ms);
+        total += ms;
+    }
+    if (encode and !corpus_file.isEmpty()) {
+        QFile file(corpus_file);
+        if (!file.open(QIODevice::WriteOnly) or file.write(data) != data.size()) {
+            result["error"] = "could not write " + corpus_file;
+            return result;
+        }
+    }
+    std::sort(latency.begin(), latency.end());
+    double megapixels = double(bench_case.size.width()) * bench_case.size.height() / 1e6;
+    result["encoded_bytes"] = double(data.size());
+    result["mpix_per_s"] = round3(megapixels * bench_case.repeat / (total / 1000));
+    result["p50_ms"] = round3(percentile(latency, 50));
+    result["p90_ms"] = round3(percentile(latency, 90));
+    result["p99_ms"] = round3(percentile(latency, 99));
+    result["peak_rss_kb"] = double(peakRssKb());
+    return result;
+}
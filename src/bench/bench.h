@@ -0,0 +1,25 @@
+#pragma once
+#include <QImage>
+#include <QString>
+#include <QJsonObject>
+
+// one benchmark case. each case is run in a process of its own, so that the
+// peak RSS is of that case only
+struct BenchCase
+{
+    QString format;     // jp2, webp or avif
+    QString mode;       // decode, encode, probe, scaled or clipped
+    QString api;        // reader (QImageReader/QImageWriter) or handler
+    QSize size;
+    QString depth;      // rgb8, rgba8, rgb16 or gray8
+    int repeat;
+};
+
+QString caseToString(const BenchCase &bench_case);
+bool caseFromString(QString str, BenchCase &bench_case);
+
+QImage syntheticImage(QSize size, QString depth);
+QString findPlugin(QString dir, QString format);
+QJsonObject runCase(const BenchCase &bench_case, QString plugin_dir,
+                    QString corpus_file=QString());
+qint64 peakRssKb();
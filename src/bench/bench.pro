@@ -0,0 +1,16 @@
+TARGET  = qimageformats-bench
+TEMPLATE = app
+QT += core gui
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+# built next to the plugins, which are loaded from the same directory
+DESTDIR = ..
+BUILD_DIR = ../../build
+MOC_DIR =     $$BUILD_DIR
+RCC_DIR =     $$BUILD_DIR
+OBJECTS_DIR = $$BUILD_DIR
+mytarget.commands += $${QMAKE_MKDIR} $$BUILD_DIR
+
+HEADERS += $$files(*.h)
+SOURCES += $$files(*.cpp)
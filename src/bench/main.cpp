@@ -0,0 +1,221 @@
+/*  This file is a part of qt-imageformat-plugins project, and is GNU LGPLv2.1 licensed
+*/
+#include "bench.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QJsonDocument>
+#include <QTemporaryDir>
+#include <QProcess>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QDebug>
+#include <cstdio>
+
+static QStringList splitList(QString str)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,14,0)
+    return str.split(',', Qt::SkipEmptyParts);
+#else
+    return str.split(',', QString::SkipEmptyParts);
+#endif
+}
+
+// N or WxH
+static QSize parseSize(QString str)
+{
+    QStringList list = str.split('x');
+    if (list.size() == 1)
+        return QSize(list[0].toInt(), list[0].toInt());
+    if (list.size() == 2)
+        return QSize(list[0].toInt(), list[1].toInt());
+    return QSize();
+}
+
+// runs a single case, and prints result as one line of JSON
+static int runChild(QString case_str, QString plugin_dir, QString library_path,
+                    QString corpus_file)
+{
+    BenchCase bench_case;
+    if (!caseFromString(case_str, bench_case)) {
+        qDebug() << "invalid case" << case_str;
+        return 1;
+    }
+    // so that QImageReader finds only the plugins under test
+    if (!library_path.isEmpty())
+        QCoreApplication::setLibraryPaths(QStringList(library_path));
+    QJsonObject result = runCase(bench_case, plugin_dir, corpus_file);
+    QByteArray line = QJsonDocument(result).toJson(QJsonDocument::Compact);
+    fwrite(line.constData(), 1, line.size(), stdout);
+    fputc('\n', stdout);
+    return result.contains("error") ? 2 : 0;
+}
+
+// runs itself with args, and returns the JSON line it printed, or empty
+// line if it crashed or was killed
+static QByteArray runProcess(QStringList args, int &exit_code)
+{
+    QProcess process;
+    process.setStandardErrorFile(QProcess::nullDevice());
+    process.start(QCoreApplication::applicationFilePath(), args);
+    process.waitForFinished(-1);
+    exit_code = process.exitStatus() == QProcess::NormalExit ? process.exitCode() : -1;
+    QByteArray line = process.readAllStandardOutput().trimmed();
+    if (QJsonDocument::fromJson(line).isNull())
+        return QByteArray();
+    return line;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmark of the image format plugins. Prints one "
+                                     "JSON object per case.");
+    parser.addHelpOption();
+    QCommandLineOption formats_opt("formats", "Comma separated formats, default is each of "
+                                   "jp2, webp and avif whose plugin is found.", "list");
+    QCommandLineOption modes_opt("modes", "decode, encode, probe, scaled and/or clipped.",
+                                 "list", "decode,encode,probe,scaled,clipped");
+    QCommandLineOption apis_opt("apis", "reader (QImageReader/QImageWriter) and/or handler.",
+                                "list", "reader,handler");
+    QCommandLineOption sizes_opt("sizes", "Image sizes, N or WxH.", "list", "512,2048");
+    QCommandLineOption depths_opt("depths", "rgb8, rgba8, rgb16 and/or gray8.",
+                                  "list", "rgb8,rgba8,rgb16,gray8");
+    QCommandLineOption repeat_opt("repeat", "Timed runs per case, after one warm up run.",
+                                  "count", "5");
+    QCommandLineOption plugins_opt("plugins", "Directory of the plugin libraries.", "dir",
+                                   QCoreApplication::applicationDirPath());
+    QCommandLineOption output_opt("output", "Output file, default is stdout.", "file");
+    // used when running itself as child process
+    QCommandLineOption run_opt("run", "Run a single case.", "case");
+    QCommandLineOption library_opt("library-path", "Qt plugin path of child process.", "dir");
+    QCommandLineOption corpus_opt("corpus", "Encoded input, or output of encode mode.", "file");
+#if QT_VERSION >= QT_VERSION_CHECK(5,8,0)
+    run_opt.setFlags(QCommandLineOption::HiddenFromHelp);
+    library_opt.setFlags(QCommandLineOption::HiddenFromHelp);
+    corpus_opt.setFlags(QCommandLineOption::HiddenFromHelp);
+#endif
+    parser.addOption(formats_opt);
+    parser.addOption(modes_opt);
+    parser.addOption(apis_opt);
+    parser.addOption(sizes_opt);
+    parser.addOption(depths_opt);
+    parser.addOption(repeat_opt);
+    parser.addOption(plugins_opt);
+    parser.addOption(output_opt);
+    parser.addOption(run_opt);
+    parser.addOption(library_opt);
+    parser.addOption(corpus_opt);
+    parser.process(app);
+
+    QString plugin_dir = QFileInfo(parser.value(plugins_opt)).absoluteFilePath();
+    if (parser.isSet(run_opt))
+        return runChild(parser.value(run_opt), plugin_dir, parser.value(library_opt),
+                        parser.value(corpus_opt));
+
+    QFile output;
+    if (parser.isSet(output_opt)) {
+        output.setFileName(parser.value(output_opt));
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Text)) {
+            qDebug() << "could not open" << parser.value(output_opt);
+            return 1;
+        }
+    }
+    else
+        output.open(stdout, QIODevice::WriteOnly | QIODevice::Text);
+
+    // Qt searches <library path>/imageformats for plugins. link only the
+    // plugins from plugin_dir there, so that the reader api does not pick
+    // the installed ones
+    QTemporaryDir library_dir;
+    QDir(library_dir.path()).mkdir("imageformats");
+    QDir(library_dir.path()).mkdir("corpus");
+    // plugins which are not built, e.g avif, are skipped unless asked for
+    QStringList formats;
+    if (parser.isSet(formats_opt))
+        formats = splitList(parser.value(formats_opt));
+    else {
+        foreach (QString format, QString("jp2,webp,avif").split(',')) {
+            if (!findPlugin(plugin_dir, format).isEmpty())
+                formats << format;
+        }
+        if (formats.isEmpty()) {
+            qDebug() << "no plugins found in" << plugin_dir;
+            return 1;
+        }
+    }
+    foreach (QString format, formats) {
+        QString plugin = findPlugin(plugin_dir, format);
+        if (plugin.isEmpty()) {
+            qDebug() << "plugin not found for" << format << "in" << plugin_dir;
+            continue;
+        }
+        QFile::link(plugin, library_dir.path() + "/imageformats/" + QFileInfo(plugin).fileName());
+    }
+
+    int repeat = qMax(parser.value(repeat_opt).toInt(), 1);
+    int failed = 0;
+    foreach (QString format, formats)
+    foreach (QString size_str, splitList(parser.value(sizes_opt)))
+    foreach (QString depth, splitList(parser.value(depths_opt)))
+    foreach (QString mode, splitList(parser.value(modes_opt)))
+    foreach (QString api, splitList(parser.value(apis_opt)))
+    {
+        BenchCase bench_case;
+        bench_case.format = format;
+        bench_case.mode = mode;
+        bench_case.api = api;
+        bench_case.size = parseSize(size_str);
+        bench_case.depth = depth;
+        bench_case.repeat = repeat;
+        if (bench_case.size.isEmpty()) {
+            qDebug() << "invalid size" << size_str;
+            return 1;
+        }
+        QStringList args;
+        args << "--plugins" << plugin_dir << "--library-path" << library_dir.path();
+        int exit_code = 0;
+        QByteArray line;
+        QString error;
+        // input of decoding modes is encoded once by another process, so that
+        // the timed process does not have the encoder's peak RSS
+        if (mode != "encode") {
+            QString corpus_file = QString("%1/corpus/%2-%3-%4-%5.bin").arg(library_dir.path(),
+                                        format, size_str, depth, api);
+            if (!QFile::exists(corpus_file)) {
+                BenchCase encode_case = bench_case;
+                encode_case.mode = "encode";
+                encode_case.repeat = 1;
+                runProcess(QStringList(args) << "--run" << caseToString(encode_case)
+                           << "--corpus" << corpus_file, exit_code);
+                if (exit_code != 0)
+                    error = QString("encoding input failed with code %1").arg(exit_code);
+            }
+            args << "--corpus" << corpus_file;
+        }
+        if (exit_code == 0)
+            line = runProcess(QStringList(args) << "--run" << caseToString(bench_case), exit_code);
+        if (line.isEmpty()) {
+            // crashed or input could not be encoded, write a result anyway
+            QJsonObject result;
+            result["format"] = format;
+            result["mode"] = mode;
+            result["api"] = api;
+            result["width"] = bench_case.size.width();
+            result["height"] = bench_case.size.height();
+            result["depth"] = depth;
+            if (error.isEmpty())
+                error = QString("process exited with code %1").arg(exit_code);
+            result["error"] = error;
+            line = QJsonDocument(result).toJson(QJsonDocument::Compact);
+        }
+        if (exit_code != 0)
+            failed++;
+        output.write(line + "\n");
+        output.flush();
+    }
+    if (failed)
+        qDebug() << failed << "cases failed";
+    return failed ? 2 : 0;
+}
@@ -1,7 +1,24 @@
 #pragma once
 #include <openjpeg.h>
+#include "pack.h"
 
-static void
+/* sYCC to RGB conversion in fixed point.
+
+   This scalar function is the reference for the vector code below, and
+   both give exactly the same result. With cb and cr centred at 0 and
+   clamped to 16 bit,
+
+     r = y + ((22970 * cr + 8192) >> 14)
+     g = y - ((5636 * cb + 11698 * cr + 8192) >> 14)
+     b = y + ((29032 * cb + 8192) >> 14)
+
+   where the coefficients are 1.402, 0.344, 0.714 and 1.772 with 14 bit
+   fraction, rounded to nearest, and >> is an arithmetic shift. r, g and b
+   are then clamped to 0..upb. The products fit in 32 bit for samples of
+   up to 16 bit precision. Compared to the float formula which was used
+   earlier, results differ by at most 1.
+*/
+static inline void
 sycc_to_rgb (int  offset,
              int  upb,
              int  y,
@@ -11,411 +28,216 @@ sycc_to_rgb (int  offset,
              int *out_g,
              int *out_b)
 {
-  int r, g, b;
-
-  cb -= offset;
-  cr -= offset;
-  r = y + (int) (1.402 * (float) cr);
-
-  if (r < 0)
-    r = 0;
-  else if (r > upb)
-    r = upb;
-  *out_r = r;
-
-  g = y - (int) (0.344 * (float) cb + 0.714 * (float) cr);
-  if (g < 0)
-    g = 0;
-  else if (g > upb)
-    g = upb;
-  *out_g = g;
+  cb = qBound (-32768, cb - offset, 32767);
+  cr = qBound (-32768, cr - offset, 32767);
 
-  b = y + (int) (1.772 * (float) cb);
-  if (b < 0)
-    b = 0;
-  else if (b > upb)
-    b = upb;
-  *out_b = b;
+  *out_r = qBound (0, y + ((22970 * cr + 8192) >> 14), upb);
+  *out_g = qBound (0, y - ((5636 * cb + 11698 * cr + 8192) >> 14), upb);
+  *out_b = qBound (0, y + ((29032 * cb + 8192) >> 14), upb);
 }
 
-static bool
-sycc420_to_rgb (opj_image_t *img)
+#if defined(__SSE2__)
+static inline __m128i
+clamp4 (__m128i v, __m128i upb)
 {
-  int *d0, *d1, *d2, *r, *g, *b, *nr, *ng, *nb;
-  const int *y, *cb, *cr, *ny;
-  size_t maxw, maxh, max, offx, loopmaxw, offy, loopmaxh;
-  int offset, upb;
-  size_t i;
-
-  upb = (int) img->comps[0].prec;
-  offset = 1 << (upb - 1);
-  upb = (1 << upb) - 1;
-
-  maxw = (size_t) img->comps[0].w;
-  maxh = (size_t) img->comps[0].h;
-  max = maxw * maxh;
+  v = _mm_andnot_si128 (_mm_srai_epi32 (v, 31), v);
+  __m128i over = _mm_cmpgt_epi32 (v, upb);
+  return _mm_or_si128 (_mm_andnot_si128 (over, v), _mm_and_si128 (over, upb));
+}
 
-  y = img->comps[0].data;
-  cb = img->comps[1].data;
-  cr = img->comps[2].data;
+/* 4 pixels of sycc_to_rgb(). Saturating pack to 16 bit does the clamping
+   of cb and cr, and pmaddwd multiplies (cb, cr) pairs with 16 bit
+   coefficients, so that no 32 bit multiply (SSE4.1) is needed. */
+static inline void
+sycc4_to_rgb (__m128i  offset,
+              __m128i  upb,
+              __m128i  y,
+              __m128i  cb,
+              __m128i  cr,
+              int     *r,
+              int     *g,
+              int     *b)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i round = _mm_set1_epi32 (8192);
+  __m128i cb16 = _mm_packs_epi32 (_mm_sub_epi32 (cb, offset), zero);
+  __m128i cr16 = _mm_packs_epi32 (_mm_sub_epi32 (cr, offset), zero);
+
+  __m128i vr = _mm_madd_epi16 (_mm_unpacklo_epi16 (cr16, zero), _mm_set1_epi32 (22970));
+  __m128i vg = _mm_madd_epi16 (_mm_unpacklo_epi16 (cb16, cr16), _mm_set1_epi32 (5636 | (11698 << 16)));
+  __m128i vb = _mm_madd_epi16 (_mm_unpacklo_epi16 (cb16, zero), _mm_set1_epi32 (29032));
+
+  vr = _mm_add_epi32 (y, _mm_srai_epi32 (_mm_add_epi32 (vr, round), 14));
+  vg = _mm_sub_epi32 (y, _mm_srai_epi32 (_mm_add_epi32 (vg, round), 14));
+  vb = _mm_add_epi32 (y, _mm_srai_epi32 (_mm_add_epi32 (vb, round), 14));
+
+  _mm_storeu_si128 ((__m128i *) r, clamp4 (vr, upb));
+  _mm_storeu_si128 ((__m128i *) g, clamp4 (vg, upb));
+  _mm_storeu_si128 ((__m128i *) b, clamp4 (vb, upb));
+}
+#endif
 
-  d0 = r = (int *) malloc (sizeof (int) * max);
-  d1 = g = (int *) malloc (sizeof (int) * max);
-  d2 = b = (int *) malloc (sizeof (int) * max);
+/* Converts one row. Chroma is horizontally subsampled when dx is 2, in
+   which case pixels before offx use neutral chroma, and then each chroma
+   sample covers two pixels. cb and cr are NULL for a row without chroma. */
+static void
+sycc_row_to_rgb (const int *y,
+                 const int *cb,
+                 const int *cr,
+                 int       *r,
+                 int       *g,
+                 int       *b,
+                 int        width,
+                 int        chroma_width,
+                 int        dx,
+                 int        offx,
+                 int        offset,
+                 int        upb)
+{
+  int x = 0;
 
-  if (r == NULL || g == NULL || b == NULL)
+  if (cb == NULL)
     {
-      printf("malloc() failed in sycc420_to_rgb()\n");
-      goto out;
+      for (; x < width; x++)
+        sycc_to_rgb (offset, upb, y[x], offset, offset, r + x, g + x, b + x);
+      return;
     }
-
-  /* if img->x0 is odd, then first column shall use Cb/Cr = 0 */
-  offx = img->x0 & 1U;
-  loopmaxw = maxw - offx;
-  /* if img->y0 is odd, then first line shall use Cb/Cr = 0 */
-  offy = img->y0 & 1U;
-  loopmaxh = maxh - offy;
-
-  if (offy > 0U)
+  if (dx == 1)
+    offx = 0;
+  for (; x < offx && x < width; x++)
+    sycc_to_rgb (offset, upb, y[x], offset, offset, r + x, g + x, b + x);
+
+#if defined(__SSE2__)
+  {
+    __m128i voffset = _mm_set1_epi32 (offset);
+    __m128i vupb = _mm_set1_epi32 (upb);
+
+    if (dx == 1)
+      {
+        for (; x + 4 <= width && x + 4 <= chroma_width; x += 4)
+          sycc4_to_rgb (voffset, vupb,
+                        _mm_loadu_si128 ((const __m128i *) (y + x)),
+                        _mm_loadu_si128 ((const __m128i *) (cb + x)),
+                        _mm_loadu_si128 ((const __m128i *) (cr + x)),
+                        r + x, g + x, b + x);
+      }
+    else
+      {
+        /* x - offx is even here, so 2 chroma samples cover 4 pixels */
+        for (; x + 4 <= width && (x - offx) / 2 + 2 <= chroma_width; x += 4)
+          {
+            int c = (x - offx) / 2;
+            __m128i vcb = _mm_loadl_epi64 ((const __m128i *) (cb + c));
+            __m128i vcr = _mm_loadl_epi64 ((const __m128i *) (cr + c));
+
+            sycc4_to_rgb (voffset, vupb,
+                          _mm_loadu_si128 ((const __m128i *) (y + x)),
+                          _mm_unpacklo_epi32 (vcb, vcb),
+                          _mm_unpacklo_epi32 (vcr, vcr),
+                          r + x, g + x, b + x);
+          }
+      }
+  }
+#endif
+
+  for (; x < width; x++)
     {
-      size_t j;
+      int c = qMin ((x - offx) / dx, chroma_width - 1);
 
-      for (j = 0; j < maxw; ++j)
-        {
-          sycc_to_rgb (offset, upb, *y, 0, 0, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-        }
+      sycc_to_rgb (offset, upb, y[x], cb[c], cr[c], r + x, g + x, b + x);
     }
-
-  for (i = 0U; i < (loopmaxh & ~(size_t) 1U); i += 2U)
-    {
-      size_t j;
-
-      ny = y + maxw;
-      nr = r + maxw;
-      ng = g + maxw;
-      nb = b + maxw;
-
-      if (offx > 0U)
-        {
-          sycc_to_rgb (offset, upb, *y, 0, 0, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-
-          sycc_to_rgb (offset, upb, *ny, *cb, *cr, nr, ng, nb);
-          ++ny;
-          ++nr;
-          ++ng;
-          ++nb;
-        }
-
-      for (j = 0; j < (loopmaxw & ~(size_t) 1U); j += 2U)
-        {
-          sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-
-          sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-
-          sycc_to_rgb (offset, upb, *ny, *cb, *cr, nr, ng, nb);
-          ++ny;
-          ++nr;
-          ++ng;
-          ++nb;
-
-          sycc_to_rgb (offset, upb, *ny, *cb, *cr, nr, ng, nb);
-          ++ny;
-          ++nr;
-          ++ng;
-          ++nb;
-
-          ++cb;
-          ++cr;
-        }
-
-      if (j < loopmaxw)
-        {
-          sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-
-          sycc_to_rgb (offset, upb, *ny, *cb, *cr, nr, ng, nb);
-          ++ny;
-          ++nr;
-          ++ng;
-          ++nb;
-
-          ++cb;
-          ++cr;
-        }
-
-      y += maxw;
-      r += maxw;
-      g += maxw;
-      b += maxw;
-    }
-
-  if (i < loopmaxh)
-    {
-      size_t j;
-
-      for (j = 0U; j < (maxw & ~(size_t) 1U); j += 2U)
-        {
-          sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-
-          sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-
-          ++cb;
-          ++cr;
-        }
-
-      if (j < maxw)
-        {
-          sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-        }
-    }
-
-  free (img->comps[0].data);
-  img->comps[0].data = d0;
-  free (img->comps[1].data);
-  img->comps[1].data = d1;
-  free (img->comps[2].data);
-  img->comps[2].data = d2;
-
-  img->comps[1].w = img->comps[2].w = img->comps[0].w;
-  img->comps[1].h = img->comps[2].h = img->comps[0].h;
-  img->comps[1].dx = img->comps[2].dx = img->comps[0].dx;
-  img->comps[1].dy = img->comps[2].dy = img->comps[0].dy;
-  img->color_space = OPJ_CLRSPC_SRGB;
-
-  return true;
-
- out:
-  free (r);
-  free (g);
-  free (b);
-  return false;
 }
 
+/* Converts the sYCC planes of img (with 4:4:4, 4:2:2 or 4:2:0 chroma and an
+   optional 4th alpha plane) and packs them straight into image, which must
+   have a format returned by imageFormat() and the size of Y plane. Instead of
+   allocating three new full size planes, each band of rows uses one row of
+   temporary RGB, and bands run in parallel. Chroma of the first column
+   (and line, for 4:2:0) is neutral when img->x0 (img->y0) is odd. */
 static bool
-sycc422_to_rgb (opj_image_t *img)
+sycc_to_qimage (const opj_image_t *img,
+                QImage            &image,
+                int                threads)
 {
-  int *d0, *d1, *d2, *r, *g, *b;
-  const int *y, *cb, *cr;
-  size_t maxw, maxh, max, offx, loopmaxw;
-  int offset, upb;
-  size_t i;
-
-  upb = (int) img->comps[0].prec;
-  offset = 1 <<(upb - 1);
-  upb = (1 << upb) - 1;
-
-  maxw = (size_t) img->comps[0].w;
-  maxh = (size_t) img->comps[0].h;
-  max = maxw * maxh;
-
-  y = img->comps[0].data;
-  cb = img->comps[1].data;
-  cr = img->comps[2].data;
-
-  d0 = r = (int *) malloc (sizeof (int) * max);
-  d1 = g = (int *) malloc (sizeof (int) * max);
-  d2 = b = (int *) malloc (sizeof (int) * max);
-
-  if (r == NULL || g == NULL || b == NULL)
+  int width, height, chroma_width, chroma_height, dx, dy, offx, offy;
+  int prec, offset, upb;
+  const int *alpha;
+  uchar *bits;
+  int bpl;
+  QImage::Format format;
+
+  if (img->numcomps < 3 || img->numcomps > 4)
+    return false;
+
+  dx = img->comps[1].dx;
+  dy = img->comps[1].dy;
+  if (img->comps[0].dx != 1 || img->comps[0].dy != 1 ||
+      img->comps[2].dx != (OPJ_UINT32) dx || img->comps[2].dy != (OPJ_UINT32) dy ||
+      !((dx == 1 && dy == 1) || (dx == 2 && dy == 1) || (dx == 2 && dy == 2)))
+    {
+      qDebug ("JP2 : Cannot convert sYCC with this subsampling");
+      return false;
+    }
+  width = img->comps[0].w;
+  height = img->comps[0].h;
+  chroma_width = qMin (img->comps[1].w, img->comps[2].w);
+  chroma_height = qMin (img->comps[1].h, img->comps[2].h);
+  if (chroma_width < 1 || chroma_height < 1 ||
+      image.width () != width || image.height () != height)
+    return false;
+
+  alpha = NULL;
+  if (img->numcomps == 4)
     {
-      printf ("malloc() failed in sycc422_to_rgb()\n");
-      goto out;
+      if (img->comps[3].w != (OPJ_UINT32) width || img->comps[3].h != (OPJ_UINT32) height)
+        return false;
+      alpha = img->comps[3].data;
     }
 
-  /* if img->x0 is odd, then first column shall use Cb/Cr = 0 */
-  offx = img->x0 & 1U;
-  loopmaxw = maxw - offx;
+  offx = (dx == 2) ? (img->x0 & 1U) : 0;
+  offy = (dy == 2) ? (img->y0 & 1U) : 0;
+  prec = img->comps[0].prec;
+  offset = 1 << (prec - 1);
+  upb = (1 << prec) - 1;
+  bits = image.bits ();
+  bpl = image.bytesPerLine ();
+  format = image.format ();
 
-  for (i = 0U; i < maxh; ++i)
+  forEachRowBand (height, width, threads, [&] (int y0, int y1)
     {
-      size_t j;
-
-      if (offx > 0U)
-        {
-          sycc_to_rgb (offset, upb, *y, 0, 0, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-        }
+      std::vector<int> rgb (3 * size_t (width));
+      PackInfo info;
 
-      for (j = 0U; j < (loopmaxw & ~(size_t) 1U); j += 2U)
+      info.plane[0] = rgb.data ();
+      info.plane[1] = rgb.data () + width;
+      info.plane[2] = rgb.data () + 2 * width;
+      for (int i = 0; i < 3; i++)
         {
-          sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-
-          sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-          ++cb;
-          ++cr;
+          info.offset[i] = 0;
+          info.prec[i] = prec;
         }
+      info.offset[3] = (alpha && img->comps[3].sgnd) ? 1 << (img->comps[3].prec - 1) : 0;
+      info.prec[3] = alpha ? img->comps[3].prec : 8;
+      info.stride = 0;
+      info.width = width;
 
-      if (j < loopmaxw)
+      for (int y = y0; y < y1; y++)
         {
-          sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-          ++y;
-          ++r;
-          ++g;
-          ++b;
-          ++cb;
-          ++cr;
+          const int *cb = NULL, *cr = NULL;
+
+          if (dy == 1 || y >= offy)
+            {
+              size_t row = qMin ((y - offy) / dy, chroma_height - 1);
+
+              cb = img->comps[1].data + row * img->comps[1].w;
+              cr = img->comps[2].data + row * img->comps[2].w;
+            }
+          sycc_row_to_rgb (img->comps[0].data + size_t (y) * width, cb, cr,
+                           rgb.data (), rgb.data () + width, rgb.data () + 2 * width,
+                           width, chroma_width, dx, offx, offset, upb);
+          info.plane[3] = alpha ? alpha + size_t (y) * width : NULL;
+          packScanLine (info, 0, bits + qint64 (y) * bpl, format);
         }
-    }
-
-  free (img->comps[0].data);
-  img->comps[0].data = d0;
-  free (img->comps[1].data);
-  img->comps[1].data = d1;
-  free (img->comps[2].data);
-  img->comps[2].data = d2;
-
-  img->comps[1].w = img->comps[2].w = img->comps[0].w;
-  img->comps[1].h = img->comps[2].h = img->comps[0].h;
-  img->comps[1].dx = img->comps[2].dx = img->comps[0].dx;
-  img->comps[1].dy = img->comps[2].dy = img->comps[0].dy;
-  img->color_space = OPJ_CLRSPC_SRGB;
-
-  return (true);
-
- out:
-  free (r);
-  free (g);
-  free (b);
-  return (false);
-}
-
-static bool
-sycc444_to_rgb (opj_image_t *img)
-{
-  int *d0, *d1, *d2, *r, *g, *b;
-  const int *y, *cb, *cr;
-  size_t maxw, maxh, max, i;
-  int offset, upb;
-
-  upb = (int) img->comps[0].prec;
-  offset = 1 << (upb - 1);
-  upb = (1 << upb) - 1;
-
-  maxw = (size_t) img->comps[0].w;
-  maxh = (size_t) img->comps[0].h;
-  max = maxw * maxh;
-
-  y = img->comps[0].data;
-  cb = img->comps[1].data;
-  cr = img->comps[2].data;
-
-  d0 = r = (int *) malloc(sizeof (int) * max);
-  d1 = g = (int *) malloc(sizeof (int) * max);
-  d2 = b = (int *) malloc(sizeof (int) * max);
-
-  if (r == NULL || g == NULL || b == NULL)
-    {
-      printf("malloc() failed in sycc444_to_rgb()\n");
-      goto out;
-    }
-
-  for (i = 0U; i < max; ++i)
-    {
-      sycc_to_rgb (offset, upb, *y, *cb, *cr, r, g, b);
-      ++y;
-      ++cb;
-      ++cr;
-      ++r;
-      ++g;
-      ++b;
-    }
-
-  free (img->comps[0].data);
-  img->comps[0].data = d0;
-  free (img->comps[1].data);
-  img->comps[1].data = d1;
-  free (img->comps[2].data);
-  img->comps[2].data = d2;
-
-  img->color_space = OPJ_CLRSPC_SRGB;
+    });
   return true;
-
- out:
-  free (r);
-  free (g);
-  free (b);
-  return false;
-}
-
-static bool
-color_sycc_to_rgb (opj_image_t *img)
-{
-  if (img->numcomps < 3)
-    {
-      img->color_space = OPJ_CLRSPC_GRAY;
-      return true;
-    }
-  else if ((img->comps[0].dx == 1) &&
-           (img->comps[1].dx == 2) &&
-           (img->comps[2].dx == 2) &&
-           (img->comps[0].dy == 1) &&
-           (img->comps[1].dy == 2) &&
-           (img->comps[2].dy == 2))
-    {
-      /* horizontal and vertical sub-sample */
-      return sycc420_to_rgb (img);
-    }
-  else if ((img->comps[0].dx == 1) &&
-           (img->comps[1].dx == 2) &&
-           (img->comps[2].dx == 2) &&
-           (img->comps[0].dy == 1) &&
-           (img->comps[1].dy == 1) &&
-           (img->comps[2].dy == 1))
-    {
-      /* horizontal sub-sample only */
-      return sycc422_to_rgb (img);
-    }
-  else if ((img->comps[0].dx == 1) &&
-           (img->comps[1].dx == 1) &&
-           (img->comps[2].dx == 1) &&
-           (img->comps[0].dy == 1) &&
-           (img->comps[1].dy == 1) &&
-           (img->comps[2].dy == 1))
-    {
-      /* no sub-sample */
-      return sycc444_to_rgb (img);
-    }
-  else
-    {
-      printf("Cannot convert in color_sycc_to_rgb()\n");
-      return false;
-    }
 }
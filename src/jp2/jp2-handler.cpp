@@ -3,8 +3,15 @@
 */
 #include "jp2-handler.h"
 #include "color.h"
+#include <QThread>
+#include <QBuffer>
+#include <QFile>
 #include <QDebug>
+#include <vector>
 
+Jp2Handler:: Jp2Handler() : thread_count(defaultThreadCount()), quality(-1), compression(-1)
+{
+}
 
 bool
 Jp2Handler:: canRead() const
@@ -15,7 +22,7 @@ Jp2Handler:: canRead() const
 bool
 Jp2Handler:: read(QImage *image)
 {
-    QImage decoded = readImage(device());
+    QImage decoded = readImage(device(), scaled_size, clip_rect, thread_count, highDepth());
     if (decoded.isNull())
         return false;
     *image = decoded;
@@ -25,7 +32,76 @@ Jp2Handler:: read(QImage *image)
 bool
 Jp2Handler:: write(const QImage &image)
 {
-    return writeImage(image, device());
+    return writeImage(image, device(), quality, compression, thread_count, write_options);
+}
+
+bool
+Jp2Handler:: supportsOption(ImageOption option) const
+{
+    return option == ScaledSize or option == ClipRect or
+           option == Size or option == ImageFormat or
+           option == Quality or option == CompressionRatio or option == Description;
+}
+
+QVariant
+Jp2Handler:: option(ImageOption option) const
+{
+    switch (option) {
+    case ScaledSize:
+        return scaled_size;
+    case ClipRect:
+        return clip_rect;
+    case Quality:
+        return quality;
+    case CompressionRatio:
+        return compression;
+    case Size:
+    case ImageFormat:
+        break;
+    default:
+        return QVariant();
+    }
+    QSize size;
+    QImage::Format format;
+    if (!device() or !readImageInfo(device(), size, format, highDepth()))
+        return QVariant();
+    if (option == Size)
+        return size;
+    return format;
+}
+
+void
+Jp2Handler:: setOption(ImageOption option, const QVariant &value)
+{
+    switch (option) {
+    case ScaledSize:
+        scaled_size = value.toSize();
+        break;
+    case ClipRect:
+        clip_rect = value.toRect();
+        break;
+    case Quality:
+        quality = value.toInt();
+        break;
+    case CompressionRatio:
+        compression = value.toInt();
+        break;
+    case Description:
+        // QImageWriter::setText("tiles", "512") gives "tiles: 512"
+        parseWriteOptions(value.toString(), write_options);
+        break;
+    default:
+        break;
+    }
+}
+
+// while reading, a Quality below 50 asks for 8 bit output of images with
+// higher precision, to use half the memory (like Qt's jpeg plugin, where
+// low quality means faster decoding)
+bool
+Jp2Handler:: highDepth() const
+{
+    return quality < 0 or quality >= 50;
 }
 
 
@@ -97,28 +173,489 @@ OPJ_SIZE_T jp2_write_buffer(void *src, OPJ_SIZE_T length, void *user_data)
     return len;
 }
 
+// compressed data of QBuffer or mapped QFile, which is read without going
+// through QIODevice
+struct MemoryStream
+{
+    uchar *data;
+    qint64 size;
+    qint64 pos;
+};
+
+OPJ_SIZE_T jp2_read_memory(void *dest, OPJ_SIZE_T length, void *user_data)
+{
+    MemoryStream *memory = (MemoryStream*) user_data;
+    if (memory->pos >= memory->size)
+        return -1;
+    length = qMin(qint64(length), memory->size - memory->pos);
+    memcpy(dest, memory->data + memory->pos, length);
+    memory->pos += length;
+    return length;
+}
+
+OPJ_BOOL jp2_seek_memory(OPJ_OFF_T offset, void *user_data)
+{
+    MemoryStream *memory = (MemoryStream*) user_data;
+    if (offset < 0 or offset > memory->size)
+        return OPJ_FALSE;
+    memory->pos = offset;
+    return OPJ_TRUE;
+}
+
+OPJ_OFF_T jp2_skip_memory(OPJ_OFF_T offset, void *user_data)
+{
+    MemoryStream *memory = (MemoryStream*) user_data;
+    if (memory->pos + offset < 0)
+        return -1;
+    // skipping past the end is allowed, the next read fails
+    memory->pos += offset;
+    return offset;
+}
+
+/* memory of the data left in a QBuffer, or a QFile which is mapped, so that
+   it can be read without copying. returns NULL for other devices.
+*/
+uchar *mapDevice(QIODevice *device, qint64 &size)
+{
+    qint64 pos = device->pos();
+    size = device->size() - pos;
+    if (size <= 0)
+        return NULL;
+    QBuffer *buffer = qobject_cast<QBuffer*>(device);
+    if (buffer)
+        return (uchar*) buffer->buffer().constData() + pos;
+    QFile *file = qobject_cast<QFile*>(device);
+    if (file)
+        return file->map(pos, size);
+    return NULL;
+}
+
+/* creates a stream which reads from memory when the device is a QBuffer or
+   a QFile, or else from the device with a buffer of given size. reads larger
+   than the buffer go straight to the destination, so the memory stream uses
+   a small buffer, and large tile data is copied only once. memory must be
+   kept until the stream is destroyed, and then released with
+   releaseMemory()
+*/
+opj_stream_t *createReadStream(QIODevice *device, MemoryStream &memory, OPJ_SIZE_T buffer_size)
+{
+    opj_stream_t *stream;
+    memory.pos = 0;
+    memory.data = mapDevice(device, memory.size);
+    if (memory.data) {
+        stream = opj_stream_create(4096, OPJ_TRUE);
+        if (! stream)
+            return NULL;
+        opj_stream_set_read_function(stream, jp2_read_memory);
+        opj_stream_set_seek_function(stream, jp2_seek_memory);
+        opj_stream_set_skip_function(stream, jp2_skip_memory);
+        opj_stream_set_user_data(stream, &memory, NULL);
+        opj_stream_set_user_data_length(stream, memory.size);
+        return stream;
+    }
+    stream = opj_stream_create(buffer_size, OPJ_TRUE);
+    if (! stream)
+        return NULL;
+    opj_stream_set_read_function(stream, jp2_read_buffer);
+    opj_stream_set_seek_function(stream, jp2_seek_buffer);
+    opj_stream_set_skip_function(stream, jp2_skip_buffer);
+    opj_stream_set_user_data(stream, device, NULL);
+    opj_stream_set_user_data_length(stream, device->size());
+    return stream;
+}
+
+// unmaps the file, and moves device position past the data read from memory
+void releaseMemory(QIODevice *device, MemoryStream &memory)
+{
+    if (!memory.data)
+        return;
+    QFile *file = qobject_cast<QFile*>(device);
+    if (file)
+        file->unmap(memory.data);
+    device->seek(device->pos() + qMin(memory.pos, memory.size));
+    memory.data = NULL;
+}
+
+
+
+// QJP2_NUM_THREADS environment variable overrides the ideal thread count
+int defaultThreadCount()
+{
+    bool ok;
+    int count = qgetenv("QJP2_NUM_THREADS").toInt(&ok);
+    if (ok and count > 0)
+        return count;
+    return qMax(QThread::idealThreadCount(), 1);
+}
+
+// codec level multithreading requires OpenJPEG 2.2 (decoding) or 2.4 (encoding)
+void setCodecThreads(opj_codec_t *codec, int threads)
+{
+#if OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 2)
+    if (threads > 1 and opj_has_thread_support())
+        opj_codec_set_threads(codec, threads);
+#else
+    Q_UNUSED(codec);
+    Q_UNUSED(threads);
+#endif
+}
+
+int ceilDivPow2(qint64 a, int b)
+{
+    return (a + (qint64(1) << b) - 1) >> b;
+}
 
+// number of resolution levels that can be discarded while decoding
+int maxReduceFactor(opj_codec_t *codec, int numcomps)
+{
+    int max_reduce = 0;
+    opj_codestream_info_v2_t *info = opj_get_cstr_info(codec);
+    if (!info)
+        return 0;
+    if (info->m_default_tile_info.tccp_info) {
+        max_reduce = 32;
+        for (int i=0; i<numcomps; i++)
+            max_reduce = qMin(max_reduce, int(info->m_default_tile_info.tccp_info[i].numresolutions) - 1);
+    }
+    opj_destroy_cstr_info(&info);
+    return qMax(max_reduce, 0);
+}
+
+// largest reduce factor for which the decoded area is not smaller than size
+int reduceFactorForSize(opj_codec_t *codec, opj_image_t *jp2_image, QRect area, QSize size)
+{
+    int max_reduce = maxReduceFactor(codec, jp2_image->numcomps);
+    int reduce = 0;
+    while (reduce < max_reduce) {
+        int next = reduce + 1;
+        int w = ceilDivPow2(area.x() + area.width(), next) - ceilDivPow2(area.x(), next);
+        int h = ceilDivPow2(area.y() + area.height(), next) - ceilDivPow2(area.y(), next);
+        if (w < size.width() or h < size.height())
+            break;
+        reduce = next;
+    }
+    return reduce;
+}
 
-QImage readImage(QIODevice *device)
+// format of the QImage to which an image with given channels is decoded.
+// high_depth is for images of more than 8 bit precision, which need Qt 5.12
+// for RGBA64 and 5.13 for Grayscale16. single channel images are gray,
+// Grayscale8 needs Qt 5.5
+QImage::Format imageFormat(int channels, bool high_depth)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+    if (high_depth) {
+#if QT_VERSION >= QT_VERSION_CHECK(5,13,0)
+        if (channels==1)
+            return QImage::Format_Grayscale16;
+#endif
+        if (channels==1 or channels==3)
+            return QImage::Format_RGBX64;
+        return QImage::Format_RGBA64;
+    }
+#else
+    Q_UNUSED(high_depth);
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5,5,0)
+    if (channels==1)
+        return QImage::Format_Grayscale8;
+#endif
+    if (channels==1 or channels==3)
+        return QImage::Format_RGB32;
+    return QImage::Format_ARGB32;
+}
+
+// highest precision of all components
+int maxPrecision(const opj_image_t *jp2_image)
+{
+    int prec = 0;
+    for (OPJ_UINT32 i=0; i<jp2_image->numcomps; i++)
+        prec = qMax(prec, int(jp2_image->comps[i].prec));
+    return prec;
+}
+
+// JP2 header boxes which opj_decode() applies to the image after decoding the
+// codestream. opj_decode_tile_data() does not apply them
+struct ColorBoxes
+{
+    int channels;   // channels after palette expansion, 0 if there is no palette
+    int prec;       // highest precision of palette entries
+    bool reorder;   // a cmap or cdef box may reorder channels
+};
+
+quint32 readUint32BE(const uchar *p)
+{
+    return (quint32(p[0]) << 24) | (quint32(p[1]) << 16) | (quint32(p[2]) << 8) | p[3];
+}
+
+// jp2h larger than this is not read
+#define MAX_JP2H_SIZE (16*1024*1024)
+
+// finds a box of given type among the boxes from begin to end, where end is
+// the end of parent box, and sets begin and end to its contents. a box which
+// overruns the parent box is rejected. only boxes whose header is in data
+// are found, but contents may be beyond data
+bool findBox(const QByteArray &data, const char *type, qint64 &begin, qint64 &end)
+{
+    const uchar *p = (const uchar*) data.constData();
+    qint64 limit = qMin(end, qint64(data.size()));
+    qint64 pos = begin;
+    while (pos + 8 <= limit) {
+        qint64 len = readUint32BE(p + pos);
+        int header = 8;
+        if (len == 1) {// 64 bit box length
+            if (pos + 16 > limit)
+                return false;
+            len = (qint64(readUint32BE(p + pos + 8)) << 32) | readUint32BE(p + pos + 12);
+            header = 16;
+        }
+        else if (len == 0)// last box
+            len = end - pos;
+        if (len < header or len > end - pos)
+            return false;
+        if (memcmp(p + pos + 4, type, 4) == 0) {
+            begin = pos + header;
+            end = pos + len;
+            return true;
+        }
+        pos += len;
+    }
+    return false;
+}
+
+// reads the boxes of jp2h without moving the device position. returns false
+// if jp2h could not be parsed
+bool readColorBoxes(QIODevice *device, ColorBoxes &boxes)
+{
+    boxes.channels = 0;
+    boxes.prec = 0;
+    boxes.reorder = false;
+    QByteArray data = device->peek(4096);
+    qint64 begin = 0, end = MAX_JP2H_SIZE;
+    if (!findBox(data, "jp2h", begin, end))
+        return false;
+    // jp2h is larger when it has an ICC profile
+    if (end > data.size()) {
+        data = device->peek(end);
+        if (data.size() < end)
+            return false;
+    }
+    // sub-boxes are within jp2h, and so within data
+    qint64 pclr_begin = begin, pclr_end = end;
+    qint64 cmap_begin = begin, cmap_end = end;
+    qint64 cdef_begin = begin, cdef_end = end;
+    bool has_pclr = findBox(data, "pclr", pclr_begin, pclr_end);
+    bool has_cmap = findBox(data, "cmap", cmap_begin, cmap_end);
+    boxes.reorder = has_cmap or findBox(data, "cdef", cdef_begin, cdef_end);
+    // palette is expanded to one channel for each cmap entry
+    if (has_pclr and has_cmap) {
+        if (pclr_end - pclr_begin < 3)
+            return false;
+        int npc = uchar(data[int(pclr_begin + 2)]);
+        if (pclr_end - pclr_begin < 3 + npc)
+            return false;
+        for (int i=0; i<npc; i++)
+            boxes.prec = qMax(boxes.prec, (uchar(data[int(pclr_begin + 3 + i)]) & 0x7f) + 1);
+        boxes.channels = (cmap_end - cmap_begin) / 4;
+    }
+    return true;
+}
+
+// read only the main header to get image size and format, the device
+// position is restored afterwards
+bool readImageInfo(QIODevice *device, QSize &size, QImage::Format &format, bool high_depth)
+{
+    bool success = false;
+    qint64 pos = device->pos();
+    OPJ_CODEC_FORMAT codec_format = isJ2k(device) ? OPJ_CODEC_J2K : OPJ_CODEC_JP2;
+    opj_image_t *jp2_image = NULL;
+    opj_codec_t *codec = NULL;
+    opj_dparameters_t  parameters;
+    MemoryStream memory;
+    ColorBoxes boxes;
+    int channels, prec;
+    // the codestream header has the components before palette expansion
+    bool has_boxes = codec_format == OPJ_CODEC_JP2 and readColorBoxes(device, boxes);
+
+    // a small buffer, so that not much more than the header is read
+    opj_stream_t *stream = createReadStream(device, memory, 4096);
+    if (! stream)
+        goto end;
+
+    codec = opj_create_decompress (codec_format);
+    opj_set_default_decoder_parameters (&parameters);
+    if (opj_setup_decoder (codec, &parameters) != OPJ_TRUE)
+        goto end;
+
+    if (opj_read_header (stream, codec, &jp2_image) != OPJ_TRUE)
+        goto end;
+    if (jp2_image->numcomps < 1 or jp2_image->numcomps > 4)
+        goto end;
+
+    channels = jp2_image->numcomps;
+    prec = maxPrecision(jp2_image);
+    if (has_boxes and boxes.channels > 0) {
+        channels = boxes.channels;
+        prec = boxes.prec;
+    }
+    if (channels > 4)
+        goto end;
+    size = QSize(jp2_image->comps[0].w, jp2_image->comps[0].h);
+    format = imageFormat(channels, high_depth and prec > 8);
+    success = true;
+end:
+    if (jp2_image)
+        opj_image_destroy (jp2_image);
+    if (codec)
+        opj_destroy_codec (codec);
+    if (stream)
+        opj_stream_destroy (stream);
+    releaseMemory(device, memory);
+    device->seek(pos);
+    return success;
+}
+
+// tiled images with components of same size are decoded tile by tile, sYCC
+// images need the whole image for conversion. tiles are decoded without the
+// palette and channel definition of JP2 header, so those go through opj_decode()
+bool canDecodeTiles(opj_codec_t *codec, const opj_image_t *jp2_image, bool plain_codestream)
+{
+    if (!plain_codestream or jp2_image->numcomps < 1 or jp2_image->numcomps > 4 or
+        jp2_image->color_space == OPJ_CLRSPC_SYCC)
+        return false;
+    for (OPJ_UINT32 i=0; i<jp2_image->numcomps; i++) {
+        if (jp2_image->comps[i].dx != 1 or jp2_image->comps[i].dy != 1)
+            return false;
+    }
+    opj_codestream_info_v2_t *info = opj_get_cstr_info(codec);
+    if (!info)
+        return false;
+    bool tiled = info->tw * info->th > 1;
+    opj_destroy_cstr_info(&info);
+    return tiled;
+}
+
+// copies a row of tile samples, which are 1, 2 or 4 bytes wide as written
+// by opj_decode_tile_data(), to int samples
+void tileRowToInt(const uchar *plane, int bytes, bool sgnd, size_t start, int width, int *dst)
+{
+    switch (bytes) {
+    case 1:
+        for (int x=0; x<width; x++)
+            dst[x] = sgnd ? ((const qint8*) plane)[start + x] : plane[start + x];
+        break;
+    case 2:
+        for (int x=0; x<width; x++)
+            dst[x] = sgnd ? ((const qint16*) plane)[start + x] : ((const quint16*) plane)[start + x];
+        break;
+    default:
+        memcpy(dst, (const qint32*) plane + start, width * sizeof(int));
+        break;
+    }
+}
+
+/* decodes tiles one by one, and packs each tile into the QImage right away
+   and then reuses its buffer for the next tile. so only one tile of samples
+   is held besides the QImage, instead of int planes of the whole image.
+   reduce is the resolution factor set on codec.
+*/
+QImage decodeTiles(opj_codec_t *codec, opj_stream_t *stream, const opj_image_t *jp2_image,
+                   int reduce, int threads, bool high_depth)
+{
+    int channels = jp2_image->numcomps;
+    int x0 = ceilDivPow2(jp2_image->x0, reduce);
+    int y0 = ceilDivPow2(jp2_image->y0, reduce);
+    int w = ceilDivPow2(jp2_image->x1, reduce) - x0;
+    int h = ceilDivPow2(jp2_image->y1, reduce) - y0;
+    QImage image(w, h, imageFormat(channels, high_depth and maxPrecision(jp2_image) > 8));
+    if (image.isNull())
+        return image;
+    // in case some tiles are missing in a truncated codestream
+    image.fill(0);
+
+    uchar *bits = image.bits();
+    int bpl = image.bytesPerLine();
+    int pixel_bytes = image.depth() / 8;
+    QImage::Format format = image.format();
+    std::vector<uchar> tile;
+
+    while (true) {
+        OPJ_UINT32 tile_index, data_size, nb_comps;
+        OPJ_INT32 tx0, ty0, tx1, ty1;
+        OPJ_BOOL go_on;
+        if (opj_read_tile_header(codec, stream, &tile_index, &data_size,
+                                 &tx0, &ty0, &tx1, &ty1, &nb_comps, &go_on) != OPJ_TRUE) {
+            qDebug("JP2 : Couldn't read tile header");
+            return QImage();
+        }
+        if (!go_on)
+            break;
+        int left = ceilDivPow2(tx0, reduce);
+        int top = ceilDivPow2(ty0, reduce);
+        QRect rect(left - x0, top - y0, ceilDivPow2(tx1, reduce) - left,
+                   ceilDivPow2(ty1, reduce) - top);
+        // tile data has a plane of each component one after another
+        size_t offset[4], tile_size = 0;
+        int bytes[4];
+        for (int i=0; i<channels; i++) {
+            int prec = jp2_image->comps[i].prec;
+            bytes[i] = prec > 16 ? 4 : (prec > 8 ? 2 : 1);
+            offset[i] = tile_size;
+            tile_size += size_t(rect.width()) * rect.height() * bytes[i];
+        }
+        if (nb_comps != OPJ_UINT32(channels) or data_size != tile_size or
+            !image.rect().contains(rect)) {
+            qDebug("JP2 : Unexpected size of tile %d", tile_index);
+            return QImage();
+        }
+        tile.resize(data_size);
+        if (opj_decode_tile_data(codec, tile_index, tile.data(), data_size, stream) != OPJ_TRUE) {
+            qDebug("JP2 : Couldn't decode tile %d", tile_index);
+            return QImage();
+        }
+
+        forEachRowBand(rect.height(), rect.width(), threads, [&](int row0, int row1) {
+            std::vector<int> samples(size_t(channels) * rect.width());
+            const int *planes[4];
+            for (int i=0; i<channels; i++)
+                planes[i] = samples.data() + size_t(i) * rect.width();
+            PackInfo info;
+            setPackPlanes(info, jp2_image, planes);
+            info.stride = 0;
+            info.width = rect.width();
+            for (int y=row0; y<row1; y++) {
+                for (int i=0; i<channels; i++)
+                    tileRowToInt(tile.data() + offset[i], bytes[i], jp2_image->comps[i].sgnd,
+                                 size_t(y) * rect.width(), rect.width(), samples.data() + size_t(i) * rect.width());
+                packScanLine(info, 0, bits + qint64(rect.y() + y) * bpl + rect.x() * pixel_bytes, format);
+            }
+        });
+    }
+    return image;
+}
+
+QImage readImage(QIODevice *device, QSize scaled_size, QRect clip_rect, int threads,
+                 bool high_depth)
 {
     QImage image;
-    int w, h, depth, channels, colorspace;
+    int w, h, depth, channels, colorspace, reduce = 0;
+    QRect area;// decoded area on the reference grid
     // colorspace list according to OPJ_COLOR_SPACE enum
     QStringList clrspc_str = {"Unspecified", "sRGB", "Gray", "YCbCr", "xvYCC", "CMYK"};
 
     OPJ_CODEC_FORMAT format = isJ2k(device) ? OPJ_CODEC_J2K : OPJ_CODEC_JP2;
     opj_image_t *jp2_image = NULL;
     opj_codec_t *codec = NULL;
+    MemoryStream memory;
+    ColorBoxes boxes;
+    // read before the stream moves the device
+    bool plain_codestream = format == OPJ_CODEC_J2K or
+            (readColorBoxes(device, boxes) and boxes.channels == 0 and !boxes.reorder);
 
-    opj_stream_t *stream = opj_stream_default_create (OPJ_TRUE);
+    opj_stream_t *stream = createReadStream(device, memory, OPJ_J2K_STREAM_CHUNK_SIZE);
     if (! stream)
         goto end;
 
-    opj_stream_set_read_function(stream, jp2_read_buffer);
-    opj_stream_set_seek_function(stream, jp2_seek_buffer);
-    opj_stream_set_user_data(stream, device, NULL);
-    opj_stream_set_user_data_length(stream, device->size());
-
     codec = opj_create_decompress (format);
 
     opj_dparameters_t  parameters;
@@ -127,11 +664,47 @@ QImage readImage(QIODevice *device)
     if (opj_setup_decoder (codec, &parameters) != OPJ_TRUE)
         goto end;
 
+    setCodecThreads(codec, threads);
+
     if (opj_read_header (stream, codec, &jp2_image) != OPJ_TRUE)
     {
         qDebug("JP2 : Couldn't read header");
         goto end;
     }
+    area = QRect(jp2_image->x0, jp2_image->y0,
+                jp2_image->x1 - jp2_image->x0, jp2_image->y1 - jp2_image->y0);
+    if (clip_rect.isValid()) {
+        area = clip_rect.translated(area.topLeft()).intersected(area);
+        if (area.isEmpty())
+            goto end;
+    }
+    // decode at the lowest resolution level which is still large enough,
+    // and then scale down the rest of the way
+    if (!scaled_size.isEmpty()) {
+        reduce = reduceFactorForSize(codec, jp2_image, area, scaled_size);
+        if (reduce > 0 and opj_set_decoded_resolution_factor(codec, reduce) != OPJ_TRUE) {
+            qDebug("JP2 : Couldn't set resolution factor");
+            goto end;
+        }
+    }
+    // only code-blocks intersecting the clip rect are decoded
+    if (clip_rect.isValid() and
+        opj_set_decode_area(codec, jp2_image, area.x(), area.y(),
+                            area.x() + area.width(), area.y() + area.height()) != OPJ_TRUE)
+    {
+        qDebug("JP2 : Couldn't set decode area");
+        goto end;
+    }
+    // a clip rect needs the whole image path, where OpenJPEG crops the tiles
+    if (!clip_rect.isValid() and canDecodeTiles(codec, jp2_image, plain_codestream)) {
+        image = decodeTiles(codec, stream, jp2_image, reduce, threads, high_depth);
+        if (image.isNull() or opj_end_decompress(codec, stream) != OPJ_TRUE) {
+            qDebug("JP2 : Couldn't decode tiles");
+            image = QImage();
+            goto end;
+        }
+        goto scale;
+    }
 
     if (opj_decode (codec, stream, jp2_image) != OPJ_TRUE)
     {
@@ -154,69 +727,414 @@ QImage readImage(QIODevice *device)
     if (colorspace!=-1)
         qDebug()<< "colorspace :"<< clrspc_str[colorspace];
 
-    if (colorspace == OPJ_CLRSPC_SYCC) {
-        if (! color_sycc_to_rgb (jp2_image)) {
-            printf("JP2 : sYCC to sRGB conversion failed\n");
+    if (channels<1 or channels>4)
+        goto end;
+    high_depth = high_depth and maxPrecision(jp2_image) > 8;
+    // sYCC is converted and packed straight into the QImage
+    if (colorspace == OPJ_CLRSPC_SYCC and channels >= 3) {
+        image = QImage(w, h, imageFormat(channels, high_depth));
+        if (image.isNull() or !sycc_to_qimage(jp2_image, image, threads)) {
+            qDebug("JP2 : sYCC to sRGB conversion failed");
+            image = QImage();
             goto end;
         }
+        goto scale;
     }
-
-    if (channels>4)
+    for (int i=1; i<channels; i++) {
+        if (jp2_image->comps[i].w != (OPJ_UINT32)w or jp2_image->comps[i].h != (OPJ_UINT32)h) {
+            qDebug("JP2 : Subsampled components are not supported");
+            goto end;
+        }
+    }
+    image = QImage(w, h, imageFormat(channels, high_depth));
+    if (image.isNull())
         goto end;
-    if (channels==1 or channels==3)
-        image = QImage(w, h, QImage::Format_RGB32);
-    else
-        image = QImage(w, h, QImage::Format_ARGB32);
+    packPlanes(jp2_image, image, threads);
+scale:
+    if (!scaled_size.isEmpty() and image.size() != scaled_size)
+        image = image.scaled(scaled_size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+end:
+    if (jp2_image)
+        opj_image_destroy (jp2_image);
+    if (codec)
+        opj_destroy_codec (codec);
+    if (stream)
+        opj_stream_destroy (stream);
+    releaseMemory(device, memory);
+    return image;
+}
+
+
+// ************** Write Image *******************
+
+// formats with more than 8 bits per color channel
+bool isHighDepth(QImage::Format format)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+    switch (format) {
+    case QImage::Format_BGR30:
+    case QImage::Format_A2BGR30_Premultiplied:
+    case QImage::Format_RGB30:
+    case QImage::Format_A2RGB30_Premultiplied:
+    case QImage::Format_RGBX64:
+    case QImage::Format_RGBA64:
+    case QImage::Format_RGBA64_Premultiplied:
+#if QT_VERSION >= QT_VERSION_CHECK(5,13,0)
+    case QImage::Format_Grayscale16:
+#endif
+        return true;
+    default:
+        break;
+    }
+#else
+    Q_UNUSED(format);
+#endif
+    return false;
+}
+
+// grayscale images are written with a single component (since Qt 5.5)
+bool isGray(const QImage &image)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,5,0)
+    switch (image.format()) {
+    case QImage::Format_Grayscale8:
+#if QT_VERSION >= QT_VERSION_CHECK(5,13,0)
+    case QImage::Format_Grayscale16:
+#endif
+        return true;
+    case QImage::Format_Mono:
+    case QImage::Format_MonoLSB:
+    case QImage::Format_Indexed8:
+        return image.isGrayscale();
+    default:
+        break;
+    }
+#else
+    Q_UNUSED(image);
+#endif
+    return false;
+}
+
+// format to which image is converted before copying it into components
+QImage::Format writeFormat(int channels, int prec)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,5,0)
+    if (channels==1) {
+#if QT_VERSION >= QT_VERSION_CHECK(5,13,0)
+        if (prec==16)
+            return QImage::Format_Grayscale16;
+#endif
+        return QImage::Format_Grayscale8;
+    }
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+    // alpha is stored unassociated
+    if (prec==16)
+        return channels==4 ? QImage::Format_RGBA64 : QImage::Format_RGBX64;
+#endif
+    Q_UNUSED(prec);
+    return channels==4 ? QImage::Format_ARGB32 : QImage::Format_RGB32;
+}
 
-    if (channels >= 3) { // RGB or RGBA
-        for (int y=0; y<h; y++) {
-            QRgb *row = (QRgb*) image.scanLine(y);
+// copies rect of image, which has a format returned by writeFormat(), to
+// tile of planar samples in the layout expected by opj_write_tile(), where
+// T is uchar for 8 bit and quint16 for 16 bit precision
+template <typename T>
+void copyToTile(const QImage &image, QRect rect, int channels, T *tile)
+{
+    int w = rect.width();
+    size_t plane_size = size_t(w) * rect.height();
+    for (int y=0; y<rect.height(); y++) {
+        const uchar *line = image.constScanLine(rect.y() + y);
+        T *comp[4];
+        for (int i=0; i<channels; i++)
+            comp[i] = tile + i * plane_size + size_t(y) * w;
+        switch (image.format()) {
+#if QT_VERSION >= QT_VERSION_CHECK(5,5,0)
+        case QImage::Format_Grayscale8: {
+            const uchar *row = line + rect.x();
+            for (int x=0; x<w; x++)
+                comp[0][x] = row[x];
+            break;
+        }
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5,13,0)
+        case QImage::Format_Grayscale16: {
+            const quint16 *row = (const quint16*) line + rect.x();
+            for (int x=0; x<w; x++)
+                comp[0][x] = row[x];
+            break;
+        }
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+        case QImage::Format_RGBX64:
+        case QImage::Format_RGBA64: {
+            const QRgba64 *row = (const QRgba64*) line + rect.x();
             for (int x=0; x<w; x++) {
-                int r = jp2_image->comps[0].data[y*w + x];
-                int g = jp2_image->comps[1].data[y*w + x];
-                int b = jp2_image->comps[2].data[y*w + x];
-                row[x] = qRgb(r,g,b);
+                comp[0][x] = row[x].red();
+                comp[1][x] = row[x].green();
+                comp[2][x] = row[x].blue();
+                if (channels==4)
+                    comp[3][x] = row[x].alpha();
             }
+            break;
         }
-    }
-    else { // Gray or Gray with alpha
-        for (int y=0; y<h; y++) {
-            QRgb *row = (QRgb*) image.scanLine(y);
+#endif
+        default: {
+            const QRgb *row = (const QRgb*) line + rect.x();
             for (int x=0; x<w; x++) {
-                int gray = jp2_image->comps[0].data[y*w + x];
-                row[x] = qRgb(gray,gray,gray);
+                comp[0][x] = qRed(row[x]);
+                comp[1][x] = qGreen(row[x]);
+                comp[2][x] = qBlue(row[x]);
+                if (channels==4)
+                    comp[3][x] = qAlpha(row[x]);
             }
+            break;
+        }
         }
     }
-    // Put Alpha Channel
-    if (channels==2 or channels==4) {
-        for (int y=0; y<h; y++) {
-            QRgb *row = (QRgb*) image.scanLine(y);
-            for (int x=0; x<w; x++) { //last channel is alpha
-                int alpha = jp2_image->comps[channels-1].data[y*w + x];
-                row[x] = (row[x] & 0x00ffffff) | (alpha << 24);
+}
+
+/* encodes image one tile at a time, so that only one tile of samples is
+   held besides the QImage, instead of int planes of the whole image. image
+   is converted to the format returned by writeFormat() one row of tiles at
+   a time, when needed.
+   when the whole image is a single tile (small images, or tiles set to
+   "none"), the tile buffer and the conversion are of the whole image.
+*/
+bool writeTiles(opj_codec_t *codec, opj_stream_t *stream, const QImage &image,
+                int channels, int prec, int tile_w, int tile_h)
+{
+    int w = image.width();
+    int h = image.height();
+    QImage::Format format = writeFormat(channels, prec);
+    int bytes = prec > 8 ? 2 : 1;
+    int tiles_x = (w + tile_w - 1) / tile_w;
+    std::vector<uchar> tile(size_t(tile_w) * tile_h * channels * bytes);
+
+    for (int y0=0, index=0; y0<h; y0+=tile_h) {
+        int th = qMin(tile_h, h - y0);
+        QImage band = image;
+        int band_y = 0;
+        if (image.format() != format) {
+            // converts the rows of tiles from image memory without copying
+            // them first
+            band = QImage(image.constScanLine(y0), w, th, image.bytesPerLine(), image.format());
+            band.setColorTable(image.colorTable());
+            band = band.convertToFormat(format);
+            band_y = y0;
+        }
+        if (band.isNull())
+            return false;
+        for (int i=0; i<tiles_x; i++, index++) {
+            QRect rect(i * tile_w, y0 - band_y, qMin(tile_w, w - i * tile_w), th);
+            size_t size = size_t(rect.width()) * th * channels * bytes;
+            if (bytes == 2)
+                copyToTile(band, rect, channels, (quint16*) tile.data());
+            else
+                copyToTile(band, rect, channels, tile.data());
+            if (opj_write_tile(codec, index, tile.data(), size, stream) != OPJ_TRUE) {
+                qDebug("JP2 : Couldn't write tile %d", index);
+                return false;
             }
         }
     }
+    return true;
+}
 
-end:
-    if (jp2_image)
-        opj_image_destroy (jp2_image);
-    if (codec)
-        opj_destroy_codec (codec);
-    if (stream)
-        opj_stream_destroy (stream);
-    return image;
+// "512" or "512x256" to QSize, "none" to SIZE_NONE, and invalid value to
+// 0x0, i.e the default
+QSize parseSize(QString val)
+{
+    if (val == "none")
+        return SIZE_NONE;
+    QStringList list = val.split('x');
+    bool ok_w, ok_h = true;
+    int w = list[0].trimmed().toInt(&ok_w);
+    int h = w;
+    if (list.size() > 1)
+        h = list[1].trimmed().toInt(&ok_h);
+    if (list.size() > 2 or !ok_w or !ok_h or w < 1 or h < 1) {
+        qDebug() << "JP2 : Invalid size" << val << ", using default";
+        return QSize(0, 0);
+    }
+    return QSize(w, h);
 }
 
+/* keys set by QImageWriter::setText(), values are case insensitive
+   tiles : tile size, e.g "1024" or "1024x512", or "none" for single tile.
+        a single tile needs memory for samples of the whole image
+   levels : number of wavelet decomposition levels
+   layers : number of quality layers
+   progression : progression order, one of LRCP, RLCP, RPCL, PCRL, CPRL
+   codeblock : code-block size, powers of 2 from 4 to 1024, and w*h <= 4096
+   precincts : precinct size at full resolution, halved at each lower
+        resolution, powers of 2, or "none"
+*/
+void parseWriteOptions(QString description, WriteOptions &options)
+{
+    const char *prog_names[] = {"lrcp", "rlcp", "rpcl", "pcrl", "cprl"};
+    foreach (QString pair, description.split("\n\n")) {
+        QString key = pair.section(':', 0, 0).trimmed().toLower();
+        QString val = pair.section(':', 1).trimmed().toLower();
+        if (key == "tiles")
+            options.tile_size = parseSize(val);
+        else if (key == "levels")
+            options.levels = qBound(0, val.toInt(), 32);
+        else if (key == "layers")
+            options.layers = qBound(0, val.toInt(), 100);
+        else if (key == "progression") {
+            options.progression = -1;
+            for (int i=0; i<5; i++) {
+                if (val == prog_names[i])
+                    options.progression = i;
+            }
+        }
+        else if (key == "codeblock")
+            options.codeblock = parseSize(val);
+        else if (key == "precincts")
+            options.precinct = parseSize(val);
+    }
+}
 
-// ************** Write Image *******************
+bool isPowerOf2(int n)
+{
+    return n > 0 and (n & (n - 1)) == 0;
+}
 
-bool writeImage(QImage image, QIODevice *device)
+int log2Floor(int n)
 {
+    int log = 0;
+    while (n >>= 1)
+        log++;
+    return log;
+}
+
+// images larger than this in any dimension are tiled by default
+#define LARGE_IMAGE_SIZE 2048
+
+/* sets the codestream layout from options, or defaults for the image size.
+   large images get 1024x1024 tiles, RPCL progression, 256x256 precincts, and
+   enough levels for the lowest resolution to be at most 512 pixels wide
+*/
+void setWriteLayout(opj_cparameters_t &parameters, const WriteOptions &options, int w, int h)
+{
+    bool large = w > LARGE_IMAGE_SIZE or h > LARGE_IMAGE_SIZE;
+    QSize tile = options.tile_size;
+    if (tile.isNull() and large)
+        tile = QSize(1024, 1024);
+    // single tile only for small images, or when asked for. it is encoded
+    // from a buffer of the whole image
+    if (tile.isEmpty() or (tile.width() >= w and tile.height() >= h))
+        tile = QSize(w, h);
+    else {
+        parameters.tile_size_on = OPJ_TRUE;
+        parameters.cp_tdx = tile.width();
+        parameters.cp_tdy = tile.height();
+    }
+
+    // tile must have at least one sample at the lowest resolution
+    int min_size = qMin(tile.width(), tile.height());
+    int levels = options.levels;
+    if (levels <= 0) {
+        levels = parameters.numresolution - 1;
+        while ((qMax(w, h) >> levels) > 512)
+            levels++;
+    }
+    parameters.numresolution = qMin(levels, log2Floor(min_size)) + 1;
+
+    if (options.progression >= 0)
+        parameters.prog_order = (OPJ_PROG_ORDER) options.progression;
+    else if (large)
+        parameters.prog_order = OPJ_RPCL;
+
+    QSize cblk = options.codeblock;
+    if (!cblk.isEmpty()) {
+        if (isPowerOf2(cblk.width()) and isPowerOf2(cblk.height()) and
+            cblk.width() >= 4 and cblk.height() >= 4 and
+            cblk.width() <= 1024 and cblk.height() <= 1024 and
+            cblk.width() * cblk.height() <= 4096) {
+            parameters.cblockw_init = cblk.width();
+            parameters.cblockh_init = cblk.height();
+        }
+        else
+            qDebug() << "JP2 : Invalid code-block size" << cblk;
+    }
+
+    QSize prc = options.precinct;
+    if (prc.isNull() and large)
+        prc = QSize(256, 256);
+    if (!prc.isEmpty()) {
+        if (isPowerOf2(prc.width()) and isPowerOf2(prc.height()) and
+            prc.width() >= 2 and prc.height() >= 2) {
+            // precincts of lower resolutions are halved by OpenJPEG
+            parameters.csty |= 0x01;
+            parameters.res_spec = 1;
+            parameters.prcw_init[0] = prc.width();
+            parameters.prch_init[0] = prc.height();
+        }
+        else
+            qDebug() << "JP2 : Invalid precinct size" << prc;
+    }
+}
+
+/* quality layers, each layer adds to the quality of previous layers. the
+   last layer has the requested quality, and each earlier one about half the
+   size of the next one.
+   lossless : last layer has rate 0, which means no rate limit, and the one
+        before it has rate 20
+   compression > 1 : fixed file size (size = pixels_count * 3 / rate),
+        allocation by rate/distortion
+   otherwise fixed quality of given PSNR
+*/
+void setLayerQuality(opj_cparameters_t &parameters, int layers, bool lossless,
+                     int compression, double psnr)
+{
+    parameters.tcp_numlayers = layers;
+    for (int i=0; i<layers; i++) {
+        int steps = qMin(layers - 1 - i, 16);// from last layer
+        if (lossless) {
+            parameters.tcp_rates[i] = steps ? 10 << steps : 0;
+            parameters.cp_disto_alloc = OPJ_TRUE;
+        }
+        else if (compression > 1) {
+            parameters.tcp_rates[i] = compression << steps;
+            parameters.cp_disto_alloc = OPJ_TRUE;
+        }
+        else {
+            // 3 dB less is about half the size
+            parameters.tcp_distoratio[i] = qMax(psnr - 3 * steps, 1.0);
+            parameters.cp_fixed_quality = OPJ_TRUE;
+        }
+    }
+}
+
+/* quality : 0 to 100, mapped to PSNR of 25 to 50 dB, and 100 is lossless.
+        default (-1) is 40 dB.
+   compression : compression ratio (i.e rate), 1 is lossless. when set it
+        takes priority over quality.
+   Images with more than 8 bits per channel are written with 16 bit precision
+   (since Qt 5.12), and alpha channel is written as 4th component. Grayscale
+   images are written with a single component.
+   Images larger than LARGE_IMAGE_SIZE are tiled by default, so that extra
+   memory is about the size of one row of tiles. Smaller images, and images
+   written with tiles "none", are encoded as one tile, which takes extra
+   memory of the image size.
+*/
+bool writeImage(QImage image, QIODevice *device, int quality, int compression, int threads,
+                WriteOptions options)
+{
+    if (image.isNull())
+        return false;
     int w = image.width();
     int h = image.height();
     bool success = false;
+    bool gray = isGray(image);
+    int channels = gray ? 1 : (image.hasAlphaChannel() ? 4 : 3);
+    int prec = isHighDepth(image.format()) ? 16 : 8;
+    bool lossless = compression==1 or (compression<=0 and quality==100);
+    double psnr = (quality<0 or quality>100) ? 40 : 25 + quality/4.0;
 
     opj_image_t *jp2_image = NULL;
     opj_codec_t *codec = NULL;
@@ -224,43 +1142,32 @@ bool writeImage(QImage image, QIODevice *device)
 
     opj_cparameters_t  parameters;
     opj_set_default_encoder_parameters(&parameters);
-    parameters.tcp_numlayers = 1;
-    // use these options to set fixed quality
-    parameters.tcp_distoratio[0] = 40;
-    parameters.cp_fixed_quality = OPJ_TRUE;
-    // setting this 1 forces RGB->YCC conversion and higher compression
-    parameters.tcp_mct = 1; // Multiple Component Tranform
-    // Use these options to set fixed file size, (size = pixels_count * 3 / rate)
-    //parameters.tcp_rates[0] = 32; // rate 32 = 32 times compression, 1 = lossless
-    //parameters.cp_disto_alloc = OPJ_TRUE; // allocation by rate/distortion
-
-
-    opj_image_cmptparm_t comp_info[3] = {};
-    for (int i=0; i<3; i++) {
+    // setting this 1 forces RGB->YCC conversion and higher compression,
+    // it needs 3 components
+    parameters.tcp_mct = channels >= 3 ? 1 : 0; // Multiple Component Tranform
+    // lossless uses the default reversible 5/3 wavelet
+    if (lossless)
+        parameters.irreversible = 0;
+    setLayerQuality(parameters, qMax(options.layers, 1), lossless, compression, psnr);
+    setWriteLayout(parameters, options, w, h);
+
+    opj_image_cmptparm_t comp_info[4] = {};
+    for (int i=0; i<channels; i++) {
         comp_info[i].w = w;
         comp_info[i].h = h;
         comp_info[i].dx = comp_info[i].dy = 1;
-        comp_info[i].prec = comp_info[i].bpp = 8;
+        comp_info[i].prec = comp_info[i].bpp = prec;
     }
-    jp2_image = opj_image_create(3, comp_info, OPJ_CLRSPC_SRGB);
+    // without component data, which is given one tile at a time
+    jp2_image = opj_image_tile_create(channels, comp_info, gray ? OPJ_CLRSPC_GRAY : OPJ_CLRSPC_SRGB);
     if (!jp2_image) {
         qDebug("JP2 : Could not create jp2_image");
         goto end;
     }
     jp2_image->x1 = w;
     jp2_image->y1 = h;
-    // image format must be 32 bit format for copying
-    if (image.format() != QImage::Format_RGB32 and image.format() != QImage::Format_ARGB32)
-        image = image.convertToFormat(QImage::Format_RGB32);
-
-    for (int y=0; y<h; y++) {
-        QRgb *row = (QRgb*) image.constScanLine(y);
-        for (int x=0; x<w; x++) {
-            jp2_image->comps[0].data[y*w + x] = qRed(row[x]);
-            jp2_image->comps[1].data[y*w + x] = qGreen(row[x]);
-            jp2_image->comps[2].data[y*w + x] = qBlue(row[x]);
-        }
-    }
+    if (channels == 4)
+        jp2_image->comps[3].alpha = 1;
 
     stream = opj_stream_default_create (OPJ_FALSE);
     if (! stream)
@@ -277,9 +1184,21 @@ bool writeImage(QImage image, QIODevice *device)
         qDebug("JP2 : Couldn't set parameters on encoder");
         goto end;
     }
+    setCodecThreads(codec, threads);
+#if OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 5)
+    // tile-part length markers let decoders find a tile without reading
+    // through all tiles before it
+    if (parameters.tile_size_on) {
+        const char *extra_options[] = {"TLM=YES", NULL};
+        opj_encoder_set_extra_options(codec, extra_options);
+    }
+#endif
 
+    // single tile when tiling is off
     if ( opj_start_compress(codec, jp2_image, stream) != OPJ_TRUE  ||
-        opj_encode(codec, stream) != OPJ_TRUE  ||
+        !writeTiles(codec, stream, image, channels, prec,
+                    parameters.tile_size_on ? parameters.cp_tdx : w,
+                    parameters.tile_size_on ? parameters.cp_tdy : h) ||
         opj_end_compress(codec, stream) != OPJ_TRUE )
     {
         qDebug("JP2 : encoding failed");
@@ -1,16 +1,56 @@
 #pragma once
 #include <QImageIOHandler>
 #include <QImage>
+#include <QVariant>
+
+// value of a size option which turns it off, e.g single tile or maximum
+// precincts. it differs from QSize(), which is -1x-1
+#define SIZE_NONE QSize(-2, -2)
+
+// codestream layout used for writing. zero means a default chosen from the
+// image size, so that large images are tiled and can be decoded later by
+// region and by resolution
+struct WriteOptions
+{
+    QSize tile_size;    // 0x0 default, SIZE_NONE is single tile
+    int levels;         // wavelet decomposition levels
+    int layers;         // quality layers
+    int progression;    // OPJ_PROG_ORDER, -1 is default
+    QSize codeblock;    // 0x0 default
+    QSize precinct;     // 0x0 default, SIZE_NONE is maximum
+    WriteOptions() : tile_size(0, 0), levels(0), layers(0), progression(-1),
+                     codeblock(0, 0), precinct(0, 0) {}
+};
 
 class Jp2Handler : public QImageIOHandler
 {
 public:
+    Jp2Handler();
     bool canRead() const;
     bool read(QImage *image);
     bool write(const QImage &image);
+    bool supportsOption(ImageOption option) const;
+    QVariant option(ImageOption option) const;
+    void setOption(ImageOption option, const QVariant &value);
+private:
+    bool highDepth() const;
+    int thread_count;
+    int quality;
+    int compression;
+    WriteOptions write_options;
+    QSize scaled_size;
+    QRect clip_rect;
 };
 
-QImage readImage(QIODevice *device);
-bool writeImage(QImage image, QIODevice *device);
+QImage readImage(QIODevice *device, QSize scaled_size=QSize(), QRect clip_rect=QRect(),
+                 int threads=1, bool high_depth=true);
+bool writeImage(QImage image, QIODevice *device, int quality=-1, int compression=-1,
+                int threads=1, WriteOptions options=WriteOptions());
+void parseWriteOptions(QString description, WriteOptions &options);
+
+int defaultThreadCount();
 
 bool canReadImage(QIODevice *device);
+bool readImageInfo(QIODevice *device, QSize &size, QImage::Format &format,
+                   bool high_depth=true);
+QImage::Format imageFormat(int channels, bool high_depth=false);
@@ -0,0 +1,255 @@
+#pragma once
+#include <openjpeg.h>
+#include <QImage>
+#include <functional>
+#include <thread>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/* Packs decoded component planes into 32 bit QImage pixels in a single pass.
+   Planes are (R,G,B), (R,G,B,A), (Gray) or (Gray,A). Samples of any precision
+   are shifted to 8 bit (or scaled, when less than 8 bit) and then clamped.
+   SSE2 and AVX2 versions are used when enabled at compile time, and they
+   give exactly the same result as the scalar code.
+   Single channel images are packed into Grayscale8 pixels instead. High bit
+   depth images are packed the same way into RGBA64 or Grayscale16 pixels,
+   where samples are scaled to 16 bit.
+*/
+
+struct PackInfo
+{
+    const int *plane[4];// R, G, B, A planes, A is NULL when there is no alpha
+    int offset[4];      // added to signed samples to make them unsigned
+    int prec[4];
+    int stride;         // samples per row of a plane
+    int width;
+};
+
+static inline int to8bit(int val, int offset, int prec)
+{
+    val += offset;
+    if (prec > 8)
+        val >>= prec - 8;
+    else if (prec < 8)
+        val = (val * 255 + ((1 << prec) - 1) / 2) / ((1 << prec) - 1);
+    return qBound(0, val, 255);
+}
+
+#if defined(__SSE2__)
+static inline __m128i load4(const int *src, __m128i offset, __m128i shift)
+{
+    return _mm_sra_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i*)src), offset), shift);
+}
+
+// saturating packs clamp to 0-255, then bytes are transposed from
+// BBBBGGGGRRRRAAAA to BGRA BGRA BGRA BGRA, which is ARGB32 in little endian
+static inline __m128i pack4(__m128i b, __m128i g, __m128i r, __m128i a)
+{
+    __m128i v = _mm_packus_epi16(_mm_packs_epi32(b, g), _mm_packs_epi32(r, a));
+    v = _mm_unpacklo_epi8(v, _mm_srli_si128(v, 8));
+    return _mm_unpacklo_epi8(v, _mm_srli_si128(v, 8));
+}
+#endif
+
+#if defined(__AVX2__)
+static inline __m256i load8(const int *src, __m256i offset, __m128i shift)
+{
+    return _mm256_sra_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)src), offset), shift);
+}
+
+// same as pack4(), as each 128 bit lane is packed and transposed separately
+static inline __m256i pack8(__m256i b, __m256i g, __m256i r, __m256i a)
+{
+    __m256i v = _mm256_packus_epi16(_mm256_packs_epi32(b, g), _mm256_packs_epi32(r, a));
+    v = _mm256_unpacklo_epi8(v, _mm256_srli_si256(v, 8));
+    return _mm256_unpacklo_epi8(v, _mm256_srli_si256(v, 8));
+}
+#endif
+
+static void packRow(const PackInfo &info, int y, QRgb *dst)
+{
+    size_t row_start = size_t(y) * info.stride;
+    const int *r = info.plane[0] + row_start;
+    const int *g = info.plane[1] + row_start;
+    const int *b = info.plane[2] + row_start;
+    const int *a = info.plane[3] ? info.plane[3] + row_start : NULL;
+    int x = 0;
+#if defined(__SSE2__)
+    // vector code only shifts right, so it is used for 8 bit and more
+    bool simd = info.prec[0] >= 8 and info.prec[1] >= 8 and info.prec[2] >= 8 and
+                (!a or info.prec[3] >= 8);
+    if (simd) {
+        __m128i shift[4];
+        for (int i=0; i<4; i++)
+            shift[i] = _mm_cvtsi32_si128(info.prec[i] - 8);
+#if defined(__AVX2__)
+        __m256i offset8[4];
+        for (int i=0; i<4; i++)
+            offset8[i] = _mm256_set1_epi32(info.offset[i]);
+        __m256i opaque8 = _mm256_set1_epi32(255);
+        for (; x+8 <= info.width; x+=8) {
+            __m256i vr = load8(r+x, offset8[0], shift[0]);
+            __m256i vg = load8(g+x, offset8[1], shift[1]);
+            __m256i vb = load8(b+x, offset8[2], shift[2]);
+            __m256i va = a ? load8(a+x, offset8[3], shift[3]) : opaque8;
+            _mm256_storeu_si256((__m256i*)(dst+x), pack8(vb, vg, vr, va));
+        }
+#endif
+        __m128i offset[4];
+        for (int i=0; i<4; i++)
+            offset[i] = _mm_set1_epi32(info.offset[i]);
+        __m128i opaque = _mm_set1_epi32(255);
+        for (; x+4 <= info.width; x+=4) {
+            __m128i vr = load4(r+x, offset[0], shift[0]);
+            __m128i vg = load4(g+x, offset[1], shift[1]);
+            __m128i vb = load4(b+x, offset[2], shift[2]);
+            __m128i va = a ? load4(a+x, offset[3], shift[3]) : opaque;
+            _mm_storeu_si128((__m128i*)(dst+x), pack4(vb, vg, vr, va));
+        }
+    }
+#endif
+    for (; x<info.width; x++) {
+        int alpha = a ? to8bit(a[x], info.offset[3], info.prec[3]) : 255;
+        dst[x] = qRgba(to8bit(r[x], info.offset[0], info.prec[0]),
+                       to8bit(g[x], info.offset[1], info.prec[1]),
+                       to8bit(b[x], info.offset[2], info.prec[2]), alpha);
+    }
+}
+
+#if QT_VERSION >= QT_VERSION_CHECK(5,5,0)
+static void packGray8(const PackInfo &info, int y, uchar *dst)
+{
+    const int *gray = info.plane[0] + size_t(y) * info.stride;
+    int x = 0;
+#if defined(__SSE2__)
+    if (info.prec[0] >= 8) {
+        __m128i shift = _mm_cvtsi32_si128(info.prec[0] - 8);
+        __m128i offset = _mm_set1_epi32(info.offset[0]);
+        for (; x+16 <= info.width; x+=16) {
+            __m128i lo = _mm_packs_epi32(load4(gray+x, offset, shift), load4(gray+x+4, offset, shift));
+            __m128i hi = _mm_packs_epi32(load4(gray+x+8, offset, shift), load4(gray+x+12, offset, shift));
+            _mm_storeu_si128((__m128i*)(dst+x), _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+    for (; x<info.width; x++)
+        dst[x] = to8bit(gray[x], info.offset[0], info.prec[0]);
+}
+#endif
+
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+static inline quint16 to16bit(int val, int offset, int prec)
+{
+    val += offset;
+    if (prec > 16)
+        val >>= prec - 16;
+    else if (prec < 16)
+        val = (qint64(val) * 65535 + ((1 << prec) - 1) / 2) / ((1 << prec) - 1);
+    return qBound(0, val, 65535);
+}
+
+static void packRow64(const PackInfo &info, int y, QRgba64 *dst)
+{
+    size_t row_start = size_t(y) * info.stride;
+    const int *r = info.plane[0] + row_start;
+    const int *g = info.plane[1] + row_start;
+    const int *b = info.plane[2] + row_start;
+    const int *a = info.plane[3] ? info.plane[3] + row_start : NULL;
+    for (int x=0; x<info.width; x++) {
+        quint16 alpha = a ? to16bit(a[x], info.offset[3], info.prec[3]) : 65535;
+        dst[x] = QRgba64::fromRgba64(to16bit(r[x], info.offset[0], info.prec[0]),
+                                     to16bit(g[x], info.offset[1], info.prec[1]),
+                                     to16bit(b[x], info.offset[2], info.prec[2]), alpha);
+    }
+}
+#endif
+
+#if QT_VERSION >= QT_VERSION_CHECK(5,13,0)
+static void packGray16(const PackInfo &info, int y, quint16 *dst)
+{
+    const int *gray = info.plane[0] + size_t(y) * info.stride;
+    for (int x=0; x<info.width; x++)
+        dst[x] = to16bit(gray[x], info.offset[0], info.prec[0]);
+}
+#endif
+
+// packs row y into a scanline of given format, which is one of the formats
+// returned by imageFormat()
+static void packScanLine(const PackInfo &info, int y, uchar *dst, QImage::Format format)
+{
+    switch (format) {
+#if QT_VERSION >= QT_VERSION_CHECK(5,5,0)
+    case QImage::Format_Grayscale8:
+        packGray8(info, y, dst);
+        break;
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5,12,0)
+    case QImage::Format_RGBX64:
+    case QImage::Format_RGBA64:
+        packRow64(info, y, (QRgba64*) dst);
+        break;
+#endif
+#if QT_VERSION >= QT_VERSION_CHECK(5,13,0)
+    case QImage::Format_Grayscale16:
+        packGray16(info, y, (quint16*) dst);
+        break;
+#endif
+    default:
+        packRow(info, y, (QRgb*) dst);
+        break;
+    }
+}
+
+// calls func(first_row, end_row) for bands of rows in parallel
+static void forEachRowBand(int h, int w, int threads, const std::function<void(int,int)> &func)
+{
+    // not worth starting a thread for less than 256K pixels
+    threads = qMax(1, qMin(threads, int(qint64(w) * h / (1 << 18))));
+    int band = (h + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (int y=band; y<h; y+=band)
+        workers.push_back(std::thread(func, y, qMin(y+band, h)));
+    func(0, qMin(band, h));
+    for (size_t i=0; i<workers.size(); i++)
+        workers[i].join();
+}
+
+// sets R, G, B, A planes of info from samples of jp2_image components, which
+// start at planes[0] to planes[numcomps-1]
+static void setPackPlanes(PackInfo &info, const opj_image_t *jp2_image, const int *const *planes)
+{
+    int channels = jp2_image->numcomps;
+    bool has_alpha = channels == 2 or channels == 4;
+    for (int i=0; i<4; i++) {
+        int comp = (i==3) ? (has_alpha ? channels-1 : -1) : (channels >= 3 ? i : 0);
+        info.plane[i] = comp < 0 ? NULL : planes[comp];
+        info.prec[i] = comp < 0 ? 8 : jp2_image->comps[comp].prec;
+        info.offset[i] = (comp >= 0 and jp2_image->comps[comp].sgnd) ? 1 << (info.prec[i] - 1) : 0;
+    }
+}
+
+// image must have a format returned by imageFormat() and same size as
+// planes, and jp2_image must have 1 to 4 components of that size
+static void packPlanes(const opj_image_t *jp2_image, QImage &image, int threads)
+{
+    const int *planes[4];
+    for (OPJ_UINT32 i=0; i<jp2_image->numcomps and i<4; i++)
+        planes[i] = jp2_image->comps[i].data;
+    PackInfo info;
+    setPackPlanes(info, jp2_image, planes);
+    info.stride = jp2_image->comps[0].w;
+    info.width = image.width();
+
+    uchar *bits = image.bits();
+    int bpl = image.bytesPerLine();
+    QImage::Format format = image.format();
+    forEachRowBand(image.height(), image.width(), threads, [&](int y0, int y1) {
+        for (int y=y0; y<y1; y++)
+            packScanLine(info, y, bits + qint64(y) * bpl, format);
+    });
+}
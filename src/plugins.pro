@@ -1,2 +1,5 @@
 TEMPLATE = subdirs
 SUBDIRS = jp2 webp
+
+# benchmark needs Qt5 for QCommandLineParser and QJsonDocument
+greaterThan(QT_MAJOR_VERSION, 4): SUBDIRS += bench
@@ -4,28 +4,258 @@
 #include "webp-handler.h"
 #include <webp/decode.h>
 #include <webp/encode.h>
+#include <QThread>
+#include <QStringList>
+#include <QBuffer>
+#include <QFile>
 #include <QDebug>
 
+bool isBigEndian();
+WebPPreset presetFromName(QString name);
+uchar *mapDevice(QIODevice *device, qint64 &size);
+
+WebpHandler:: WebpHandler() : quality(-1), method(-1), preset(WEBP_PRESET_DEFAULT),
+                               thread_count(defaultThreadCount()), animated(-1),
+                               anim_decoder(0), next_frame(0), frame_delay(0), prev_timestamp(0)
+{
+}
+
+WebpHandler:: ~WebpHandler()
+{
+    if (anim_decoder)
+        WebPAnimDecoderDelete(anim_decoder);
+}
+
 bool
 WebpHandler:: canRead() const
 {
+    if (anim_decoder)
+        return next_frame < int(anim_info.frame_count);
     return canReadImage(device());
 }
 
 bool
 WebpHandler:: read(QImage *image)
 {
-    QImage decoded = readImage(device());
-    if (decoded.isNull())
+    if (!isAnimated()) {
+        QImage decoded = readImage(device(), scaled_size, clip_rect);
+        if (decoded.isNull())
+            return false;
+        *image = decoded;
+        next_frame++;
+        return true;
+    }
+    if (!ensureAnimDecoder() or next_frame >= int(anim_info.frame_count))
+        return false;
+    uint8_t *canvas;
+    int timestamp;
+    if (!WebPAnimDecoderGetNext(anim_decoder, &canvas, &timestamp))
         return false;
-    *image = decoded;
+    frame_delay = timestamp - prev_timestamp;
+    prev_timestamp = timestamp;
+    next_frame++;
+    // canvas is owned by the decoder and reused for next frame
+    int w = anim_info.canvas_width;
+    int h = anim_info.canvas_height;
+    QImage frame = QImage(canvas, w, h, 4*w, QImage::Format_ARGB32).copy();
+    if (frame.isNull())
+        return false;
+    if (isBigEndian())// decoder only gives BGRA, and QImage wants ARGB
+        switchByteOrder(frame);
+    if (clip_rect.isValid())
+        frame = frame.copy(clip_rect);
+    if (!scaled_size.isEmpty())
+        frame = frame.scaled(scaled_size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    *image = frame;
     return true;
 }
 
 bool
 WebpHandler:: write(const QImage &image)
 {
-    return writeImage(image, device());
+    return writeImage(image, device(), quality, method, preset, thread_count);
+}
+
+bool
+WebpHandler:: supportsOption(ImageOption option) const
+{
+    return option == ScaledSize or option == ClipRect or
+           option == Size or option == ImageFormat or option == Quality or
+           option == Description;
+}
+
+QVariant
+WebpHandler:: option(ImageOption option) const
+{
+    switch (option) {
+    case ScaledSize:
+        return scaled_size;
+    case ClipRect:
+        return clip_rect;
+    case Quality:
+        return quality;
+    case Size:
+    case ImageFormat:
+        break;
+    default:
+        return QVariant();
+    }
+    // answered from the header only, without decoding the image
+    WebPBitstreamFeatures info;
+    if (!device() or !peekFeatures(device(), &info))
+        return QVariant();
+    if (option == Size)
+        return QSize(info.width, info.height);
+    // animation frames are always decoded with alpha channel
+    bool has_alpha = info.has_alpha or info.has_animation;
+    return has_alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32;
+}
+
+void
+WebpHandler:: setOption(ImageOption option, const QVariant &value)
+{
+    switch (option) {
+    case ScaledSize:
+        scaled_size = value.toSize();
+        break;
+    case ClipRect:
+        clip_rect = value.toRect();
+        break;
+    case Quality:
+        quality = value.toInt();
+        break;
+    case Description:
+        // QImageWriter::setText("preset", "photo") gives "preset: photo"
+        foreach (QString pair, value.toString().split("\n\n")) {
+            QString key = pair.section(':', 0, 0).trimmed().toLower();
+            QString val = pair.section(':', 1).trimmed().toLower();
+            bool ok;
+            int num = val.toInt(&ok);
+            if (key == "preset")
+                preset = presetFromName(val);
+            else if (key == "method" and ok)
+                method = qBound(-1, num, 6);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+int
+WebpHandler:: imageCount() const
+{
+    if (!isAnimated())
+        return 1;
+    if (!ensureAnimDecoder())
+        return 0;
+    return anim_info.frame_count;
+}
+
+int
+WebpHandler:: currentImageNumber() const
+{
+    return next_frame - 1;
+}
+
+int
+WebpHandler:: nextImageDelay() const
+{
+    return frame_delay;
+}
+
+int
+WebpHandler:: loopCount() const
+{
+    if (!isAnimated() or !ensureAnimDecoder())
+        return 0;
+    // in WebP 0 means infinite, otherwise the number of times to play
+    if (anim_info.loop_count == 0)
+        return -1;
+    return anim_info.loop_count - 1;
+}
+
+bool
+WebpHandler:: jumpToNextImage()
+{
+    if (!isAnimated() or !ensureAnimDecoder() or next_frame >= int(anim_info.frame_count))
+        return false;
+    // skipped frame still has to be decoded to composite the next ones
+    uint8_t *canvas;
+    int timestamp;
+    if (!WebPAnimDecoderGetNext(anim_decoder, &canvas, &timestamp))
+        return false;
+    frame_delay = timestamp - prev_timestamp;
+    prev_timestamp = timestamp;
+    next_frame++;
+    return true;
+}
+
+bool
+WebpHandler:: jumpToImage(int image_number)
+{
+    if (!isAnimated() or !ensureAnimDecoder() or
+        image_number < 0 or image_number >= int(anim_info.frame_count))
+        return false;
+    if (image_number < next_frame) {
+        WebPAnimDecoderReset(anim_decoder);
+        next_frame = 0;
+        frame_delay = prev_timestamp = 0;
+    }
+    while (next_frame < image_number) {
+        if (!jumpToNextImage())
+            return false;
+    }
+    return true;
+}
+
+bool
+WebpHandler:: isAnimated() const
+{
+    if (animated == -1) {
+        WebPBitstreamFeatures info;
+        if (!device() or !peekFeatures(device(), &info))
+            return false;
+        animated = info.has_animation;
+    }
+    return animated == 1;
+}
+
+bool
+WebpHandler:: ensureAnimDecoder() const
+{
+    if (anim_decoder)
+        return true;
+    if (!device() or !data.isNull())// failed previously
+        return false;
+    // demuxer keeps pointers into the data, so it is kept with decoder. file
+    // mapping is not unmapped here, it lives until the file is closed
+    qint64 size;
+    uchar *mapped = mapDevice(device(), size);
+    if (mapped) {
+        data = QByteArray::fromRawData((const char*) mapped, size);
+        device()->seek(device()->pos() + size);
+    }
+    else
+        data = device()->readAll();
+    WebPData webp_data;
+    webp_data.bytes = (const uint8_t*) data.constData();
+    webp_data.size = data.size();
+
+    WebPAnimDecoderOptions options;
+    if (!WebPAnimDecoderOptionsInit(&options))
+        return false;
+    options.color_mode = MODE_BGRA;
+    options.use_threads = 1;
+    anim_decoder = WebPAnimDecoderNew(&webp_data, &options);
+    if (!anim_decoder or !WebPAnimDecoderGetInfo(anim_decoder, &anim_info)) {
+        qDebug() << "WebP : Couldn't create animation decoder";
+        if (anim_decoder)
+            WebPAnimDecoderDelete(anim_decoder);
+        anim_decoder = 0;
+        return false;
+    }
+    return true;
 }
 
 
@@ -52,32 +282,197 @@ bool isBigEndian()
     int i=1; return ! *((char *)&i);
 }
 
-QImage readImage(QIODevice *device)
+// QWEBP_NUM_THREADS environment variable overrides the ideal thread count
+int defaultThreadCount()
+{
+    bool ok;
+    int count = qgetenv("QWEBP_NUM_THREADS").toInt(&ok);
+    if (ok and count > 0)
+        return count;
+    return qMax(QThread::idealThreadCount(), 1);
+}
+
+// get image info from the header without consuming data from device
+bool peekFeatures(QIODevice *device, WebPBitstreamFeatures *info)
+{
+    qint64 len = 64;
+    while (1) {
+        QByteArray header = device->peek(len);
+        VP8StatusCode status = WebPGetFeatures((uchar*)header.constData(), header.size(), info);
+        if (status != VP8_STATUS_NOT_ENOUGH_DATA)
+            return status == VP8_STATUS_OK;
+        if (header.size() < len)
+            return false;
+        len *= 4;
+    }
+}
+
+/* memory of the data left in a QBuffer, or a QFile which is mapped, so that
+   it can be decoded without copying. returns NULL for other devices. mapped
+   memory is valid until unmapDevice(), or until the file is closed.
+*/
+uchar *mapDevice(QIODevice *device, qint64 &size)
+{
+    qint64 pos = device->pos();
+    size = device->size() - pos;
+    if (size <= 0)
+        return NULL;
+    QBuffer *buffer = qobject_cast<QBuffer*>(device);
+    if (buffer)
+        return (uchar*) buffer->buffer().constData() + pos;
+    QFile *file = qobject_cast<QFile*>(device);
+    if (file)
+        return file->map(pos, size);
+    return NULL;
+}
+
+void unmapDevice(QIODevice *device, uchar *mapped)
+{
+    QFile *file = qobject_cast<QFile*>(device);
+    if (file)
+        file->unmap(mapped);
+}
+
+// size of compressed data read from device at a time
+#define CHUNK_SIZE 65536
+
+// sets cropping and scaling options of config, and allocates the QImage
+// which is set as output buffer of config. libwebp rounds crop_left and
+// crop_top down to even values, so an odd origin is cropped one pixel
+// wider here, and trim_rect is set to the part to be kept by finishDecode()
+QImage prepareDecode(const WebPBitstreamFeatures &info, QSize scaled_size, QRect clip_rect,
+                     WebPDecoderConfig &config, QRect &trim_rect)
 {
     QImage image;
-    QByteArray bArr = device->readAll();
-    const uchar *data = (uchar*) bArr.constData();
-    size_t size = bArr.size();
-    // get image info (width, height, has_alpha)
+    trim_rect = QRect();
+    if (!WebPInitDecoderConfig(&config))
+        return image;
+    // libwebp crops first and then scales, same as QImageReader does
+    QSize out_size(info.width, info.height);
+    if (clip_rect.isValid()) {
+        QRect rect = clip_rect.intersected(QRect(0, 0, info.width, info.height));
+        if (rect.isEmpty())
+            return image;
+        int dx = rect.x() & 1;
+        int dy = rect.y() & 1;
+        config.options.use_cropping = 1;
+        config.options.crop_left = rect.x() - dx;
+        config.options.crop_top = rect.y() - dy;
+        config.options.crop_width = rect.width() + dx;
+        config.options.crop_height = rect.height() + dy;
+        out_size = QSize(rect.width() + dx, rect.height() + dy);
+        if (dx or dy)
+            trim_rect = QRect(dx, dy, rect.width(), rect.height());
+    }
+    // the extra column or row would be scaled in too, so scaling is then
+    // done by finishDecode() after trimming
+    if (!scaled_size.isEmpty() and scaled_size != out_size and !trim_rect.isValid()) {
+        config.options.use_scaling = 1;
+        config.options.scaled_width = scaled_size.width();
+        config.options.scaled_height = scaled_size.height();
+        out_size = scaled_size;
+    }
+    // allocate the QImage first and let libwebp decode straight into its
+    // scanlines, with same byte order as QImage
+    QImage::Format format = info.has_alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32;
+    image = QImage(out_size, format);
+    if (image.isNull())
+        return image;
+
+    config.output.colorspace = isBigEndian() ? MODE_ARGB : MODE_BGRA;
+    config.output.is_external_memory = 1;
+    config.output.u.RGBA.rgba = image.bits();
+    config.output.u.RGBA.stride = image.bytesPerLine();
+    config.output.u.RGBA.size = image.bytesPerLine() * image.height();
+    return image;
+}
+
+// removes the extra column or row of an odd crop origin, and scales if
+// libwebp could not do it
+QImage finishDecode(QImage image, QRect trim_rect, QSize scaled_size)
+{
+    if (!trim_rect.isValid())
+        return image;
+    image = image.copy(trim_rect);
+    if (!scaled_size.isEmpty() and scaled_size != image.size())
+        image = image.scaled(scaled_size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    return image;
+}
+
+// the whole data is in memory, so it is decoded in one call
+QImage decodeMemory(const uchar *data, qint64 size, QSize scaled_size, QRect clip_rect)
+{
     WebPBitstreamFeatures info;
-    VP8StatusCode status = WebPGetFeatures(data, size, &info);
+    WebPDecoderConfig config;
+    QRect trim_rect;
+    if (WebPGetFeatures(data, size, &info) != VP8_STATUS_OK)
+        return QImage();
+    QImage image = prepareDecode(info, scaled_size, clip_rect, config, trim_rect);
+    if (image.isNull())
+        return image;
+    VP8StatusCode status = WebPDecode(data, size, &config);
+    WebPFreeDecBuffer(&config.output);
+    if (status != VP8_STATUS_OK) {
+        qDebug() << "WebP : decoding failed, status" << status;
+        return QImage();
+    }
+    return finishDecode(image, trim_rect, scaled_size);
+}
+
+QImage readImage(QIODevice *device, QSize scaled_size, QRect clip_rect)
+{
+    QImage image;
+    // QBuffer and QFile data is decoded in place
+    qint64 size;
+    uchar *mapped = mapDevice(device, size);
+    if (mapped) {
+        image = decodeMemory(mapped, size, scaled_size, clip_rect);
+        unmapDevice(device, mapped);
+        device->seek(device->pos() + size);
+        return image;
+    }
+    // read until the header is complete enough to get image info
+    QByteArray header;
+    WebPBitstreamFeatures info;
+    VP8StatusCode status;
+    do {
+        QByteArray chunk = device->read(header.isEmpty() ? 64 : CHUNK_SIZE);
+        if (chunk.isEmpty())
+            return image;
+        header.append(chunk);
+        status = WebPGetFeatures((uchar*)header.constData(), header.size(), &info);
+    } while (status == VP8_STATUS_NOT_ENOUGH_DATA);
+
     if (status != VP8_STATUS_OK)
         return image;
-    // decode image with same byte order as QImage
-    int w=0, h=0;
-    uint8_t *rgb_data = 0;
-    if (isBigEndian())
-        rgb_data = WebPDecodeARGB(data, size, &w, &h);
-    else
-        rgb_data = WebPDecodeBGRA(data, size, &w, &h);
-    if (!rgb_data)
+
+    WebPDecoderConfig config;
+    QRect trim_rect;
+    image = prepareDecode(info, scaled_size, clip_rect, config, trim_rect);
+    if (image.isNull())
         return image;
-    QImage::Format format = info.has_alpha ? QImage::Format_ARGB32 : QImage::Format_RGB32;
-    image = QImage(w, h, format);
-    memcpy(image.bits(), rgb_data, w*h*4);
-    // free data
-    WebPFree(rgb_data);
-    return image;
+    // the incremental decoder writes rows into the QImage as soon as
+    // enough compressed data has been fed. it keeps its own copy of the
+    // whole bitstream for lossless and alpha images. an empty read is taken
+    // as end of data, same as readAll()
+    WebPIDecoder *idec = WebPIDecode(NULL, 0, &config);
+    if (!idec)
+        return QImage();
+    status = WebPIAppend(idec, (uchar*)header.constData(), header.size());
+    header.clear();
+    while (status == VP8_STATUS_SUSPENDED) {
+        QByteArray chunk = device->read(CHUNK_SIZE);
+        if (chunk.isEmpty())
+            break;
+        status = WebPIAppend(idec, (uchar*)chunk.constData(), chunk.size());
+    }
+    WebPIDelete(idec);
+    WebPFreeDecBuffer(&config.output);
+    if (status != VP8_STATUS_OK) {
+        qDebug() << "WebP : decoding failed, status" << status;
+        return QImage();
+    }
+    return finishDecode(image, trim_rect, scaled_size);
 }
 
 void switchByteOrder(QImage &image)
@@ -92,34 +487,124 @@ void switchByteOrder(QImage &image)
     }
 }
 
-bool writeImage(QImage image, QIODevice *device)
+WebPPreset presetFromName(QString name)
 {
-    if (image.isNull())
+    if (name == "picture")
+        return WEBP_PRESET_PICTURE;
+    if (name == "photo")
+        return WEBP_PRESET_PHOTO;
+    if (name == "drawing")
+        return WEBP_PRESET_DRAWING;
+    if (name == "icon")
+        return WEBP_PRESET_ICON;
+    if (name == "text")
+        return WEBP_PRESET_TEXT;
+    return WEBP_PRESET_DEFAULT;
+}
+
+// encoded data is streamed straight to the device as it is produced
+int writeToDevice(const uint8_t *data, size_t data_size, const WebPPicture *picture)
+{
+    QIODevice *device = (QIODevice*) picture->custom_ptr;
+    return device->write((const char*)data, data_size) == qint64(data_size);
+}
+
+/* WebPPicture::argb holds 0xAARRGGBB words same as QRgb on any byte order,
+   so 32 bit QImage rows are copied into it directly. This is used where the
+   import functions can not read QImage memory (big endian, or premultiplied
+   alpha which is converted on the way in the same pass)
+*/
+bool importArgb(WebPPicture *picture, const QImage &image)
+{
+    picture->use_argb = 1;
+    if (!WebPPictureAlloc(picture))
         return false;
-    float quality = 75;
-    int w = image.width();
-    int h = image.height();
-    uchar *output=0;
-    size_t size=0;// output file size
-    // encode image
-    if (not image.hasAlphaChannel()) {
-        image = image.convertToFormat(QImage::Format_RGB888);
-        size = WebPEncodeRGB(image.constBits(), w, h, image.bytesPerLine(), quality, &output);
-    }
-    else {
-        if (image.format() != QImage::Format_ARGB32)
-            image = image.convertToFormat(QImage::Format_ARGB32);
+    int w = picture->width;
+    for (int y=0; y<picture->height; y++) {
+        const QRgb *src = (const QRgb*) image.constScanLine(y);
+        uint32_t *dst = picture->argb + y * picture->argb_stride;
+        switch (image.format()) {
+#if QT_VERSION >= QT_VERSION_CHECK(5,3,0)
+        case QImage::Format_ARGB32_Premultiplied:
+            for (int x=0; x<w; x++)
+                dst[x] = qUnpremultiply(src[x]);
+            break;
+#endif
+        case QImage::Format_RGB32:
+            for (int x=0; x<w; x++)
+                dst[x] = src[x] | 0xff000000;
+            break;
+        default:
+            memcpy(dst, src, 4*w);
+        }
+    }
+    return true;
+}
 
-        if (isBigEndian())
-            switchByteOrder(image);
-        size = WebPEncodeBGRA(image.constBits(), w, h, image.bytesPerLine(), quality, &output);
+/* quality : 0 to 100, where 100 is lossless, default (-1) is 75
+   method : encoder method from 0 (fastest) to 6 (slowest and smallest),
+        default (-1) is 4
+   preset : tunes filtering and segments for the type of image
+   threads : multithreaded encoding is used when more than 1
+*/
+bool writeImage(QImage image, QIODevice *device, int quality, int method,
+                WebPPreset preset, int threads)
+{
+    if (image.isNull())
+        return false;
+    if (quality < 0 or quality > 100)
+        quality = 75;
+    bool success = false;
+    WebPConfig config;
+    if (!WebPConfigPreset(&config, preset, quality))
+        return false;
+    if (quality == 100) {
+        config.lossless = 1;
+        // in lossless mode quality is the effort, same as WebPEncodeLossless*()
+        config.quality = 70;
     }
-    if (size==0)
+    if (method >= 0)
+        config.method = method;
+    config.thread_level = threads > 1;
+    if (!WebPValidateConfig(&config))
         return false;
-    qint64 file_size = device->write((char*)output, size);
-    // free data
-    WebPFree(output);
-    if (file_size != size)
+
+    WebPPicture picture;
+    if (!WebPPictureInit(&picture))
         return false;
-    return true;
+    picture.width = image.width();
+    picture.height = image.height();
+    // lossless encoder works on ARGB, and lossy one on YUV
+    picture.use_argb = config.lossless;
+    picture.writer = writeToDevice;
+    picture.custom_ptr = device;
+
+    // 32 bit formats are imported from QImage memory without conversion
+    switch (image.format()) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+#if QT_VERSION >= QT_VERSION_CHECK(5,3,0)
+    case QImage::Format_ARGB32_Premultiplied:
+#endif
+        break;
+    default:
+        if (image.hasAlphaChannel())
+            image = image.convertToFormat(QImage::Format_ARGB32);
+        else
+            image = image.convertToFormat(QImage::Format_RGB32);
+    }
+    if (isBigEndian() or (image.format() != QImage::Format_RGB32 and
+                          image.format() != QImage::Format_ARGB32))
+        success = importArgb(&picture, image);
+    else if (image.format() == QImage::Format_RGB32)
+        success = WebPPictureImportBGRX(&picture, image.constBits(), image.bytesPerLine());
+    else
+        success = WebPPictureImportBGRA(&picture, image.constBits(), image.bytesPerLine());
+    if (success) {
+        success = WebPEncode(&config, &picture);
+        if (!success)
+            qDebug() << "WebP : encoding failed, error" << picture.error_code;
+    }
+    WebPPictureFree(&picture);
+    return success;
 }
@@ -1,16 +1,53 @@
 #pragma once
 #include <QImageIOHandler>
 #include <QImage>
+#include <QVariant>
+#include <webp/demux.h>
+#include <webp/encode.h>
 
 class WebpHandler : public QImageIOHandler
 {
 public:
+    WebpHandler();
+    ~WebpHandler();
     bool canRead() const;
     bool read(QImage *image);
     bool write(const QImage &image);
+    bool supportsOption(ImageOption option) const;
+    QVariant option(ImageOption option) const;
+    void setOption(ImageOption option, const QVariant &value);
+    int imageCount() const;
+    int currentImageNumber() const;
+    int nextImageDelay() const;
+    int loopCount() const;
+    bool jumpToNextImage();
+    bool jumpToImage(int image_number);
+private:
+    bool isAnimated() const;
+    bool ensureAnimDecoder() const;
+    int quality;
+    int method;
+    WebPPreset preset;
+    int thread_count;
+    QSize scaled_size;
+    QRect clip_rect;
+    // animation state, the decoder is kept alive across read() calls so that
+    // each frame is composited on top of the previous one only once
+    mutable int animated;// -1 = not known yet
+    mutable QByteArray data;
+    mutable WebPAnimDecoder *anim_decoder;
+    mutable WebPAnimInfo anim_info;
+    int next_frame;
+    int frame_delay;
+    int prev_timestamp;
 };
 
-QImage readImage(QIODevice *device);
-bool writeImage(QImage image, QIODevice *device);
+QImage readImage(QIODevice *device, QSize scaled_size=QSize(), QRect clip_rect=QRect());
+bool writeImage(QImage image, QIODevice *device, int quality=-1, int method=-1,
+                WebPPreset preset=WEBP_PRESET_DEFAULT, int threads=1);
 
 bool canReadImage(QIODevice *device);
+bool peekFeatures(QIODevice *device, WebPBitstreamFeatures *info);
+void switchByteOrder(QImage &image);
+
+int defaultThreadCount();
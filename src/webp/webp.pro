@@ -3,7 +3,7 @@ TEMPLATE = lib
 CONFIG += plugin
 
 INCLUDEPATH +=
-LIBS += -lwebp
+LIBS += -lwebp -lwebpdemux
 
 target.path += $$[QT_INSTALL_PLUGINS]/imageformats
 INSTALLS += target